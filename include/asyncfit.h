@@ -0,0 +1,171 @@
+//
+//  asyncfit.h
+//  ar-color-balancing
+//
+//  Background fitting of color balance models, published with an atomic pointer swap.
+//
+
+#ifndef asyncfit_h
+#define asyncfit_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <balance.h>
+
+namespace balance
+{
+    // Fits Model objects on a worker thread so that a frame loop never waits for a fit.
+    // submit() copies the correspondences and returns at once; if a fit is running, the
+    // request waits and a later submit() replaces it, so only the newest samples are fitted.
+    // Each finished model is published with an atomic shared_ptr store: current() returns
+    // the latest one, and a model stays alive for as long as a reader holds it.
+    //
+    // The fitter never touches a model after publishing it. Readers should treat models
+    // as immutable; the one exception is a single consumer owning the smoothing of its
+    // models between frames (see Model::blendToward).
+    //
+    // The fit shares parallel::defaultPool() with any other user. A frame loop that needs
+    // the whole pool for correction should correct on a pool of its own.
+
+    class AsyncFitter
+    {
+    public:
+        AsyncFitter(CorrectionMode in_mode = MODE_LUT,
+                    int in_lut_size = DEFAULT_LUT_SIZE,
+                    rbf::SolverType in_solver = rbf::SOLVER_LDLT,
+                    float in_support_radius = 0.0f) : mode(in_mode), lut_size(in_lut_size), solver(in_solver),
+                                                      support_radius(in_support_radius), pending(false),
+                                                      fitting(false), stop(false), published(0), fit_seconds(0.0)
+        {
+            worker = std::thread(&AsyncFitter::workerLoop, this);
+        }
+
+        ~AsyncFitter()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+            worker.join();
+        }
+
+        // Queues a fit of num_samples correspondences (source RGB then target RGB), replacing
+        // any request not yet started
+        void submit(const unsigned char* rgb_pairs, int num_samples)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                request.assign(rgb_pairs, rgb_pairs + num_samples * 6);
+                pending = true;
+            }
+            wake.notify_all();
+        }
+
+        // Latest published model, null before the first fit completes. Not lock free: the
+        // standard library guards shared_ptr atomics with a small pool of mutexes, held only
+        // for the copy. Frame loops should call it when generation() changes, not per frame.
+        std::shared_ptr<Model> current() const
+        {
+            return std::atomic_load(&model);
+        }
+
+        // Number of models published so far; changes when current() does
+        unsigned long generation() const { return published.load(std::memory_order_acquire); }
+
+        bool busy() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pending || fitting;
+        }
+
+        // Blocks until all the submitted samples are fitted
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [this]() { return !pending && !fitting; });
+        }
+
+        // Wall time of the last fit, LUT baking included, in seconds
+        double lastFitSeconds() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return fit_seconds;
+        }
+
+    private:
+        AsyncFitter(const AsyncFitter& other);
+        AsyncFitter& operator=(const AsyncFitter& other);
+
+        void workerLoop()
+        {
+            std::vector<unsigned char> samples;
+
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this]() { return stop || pending; });
+
+                    if(stop)
+                        return;
+
+                    samples.swap(request);
+                    pending = false;
+                    fitting = true;
+                }
+
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                std::shared_ptr<Model> next;
+
+                if(!samples.empty())
+                    next.reset(new Model(&samples[0], (int)samples.size() / 6, mode, lut_size, solver, support_radius));
+
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                if(next)
+                {
+                    std::atomic_store(&model, next);
+                    published.fetch_add(1, std::memory_order_release);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fitting = false;
+                    fit_seconds = seconds;
+                }
+                idle.notify_all();
+            }
+        }
+
+        const CorrectionMode mode;
+        const int lut_size;
+        const rbf::SolverType solver;
+        const float support_radius;
+
+        std::shared_ptr<Model> model;
+
+        mutable std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+
+        std::vector<unsigned char> request;
+        bool pending;
+        bool fitting;
+        bool stop;
+
+        std::atomic<unsigned long> published;
+        double fit_seconds;
+
+        std::thread worker;
+    };
+
+}
+
+#endif /* asyncfit_h */
@@ -0,0 +1,438 @@
+//
+//  balance.h
+//  ar-color-balancing
+//
+//  Color balancing model fitted from color correspondences, and its application
+//  to 8 bit BGR images on a thread pool.
+//
+
+#ifndef balance_h
+#define balance_h
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <rbf.h>
+#include <rbfsparse.h>
+#include <colors.h>
+#include <colorlut.h>
+#include <colorcache.h>
+#include <parallel.h>
+#include <profile.h>
+#include <opencv2/opencv.hpp>
+
+namespace balance
+{
+    typedef enum CorrectionMode
+    {
+        MODE_LUT,       // Lab offsets from a baked 3D lut
+        MODE_EXACT,     // full RBF evaluation, memoized per 8 bit color
+        MODE_RBF,       // full RBF evaluation of every pixel, batched on planar rows
+        MODE_LUT8,      // all integer: 8 bit Lab, quantized lut offsets, fixed point conversions
+
+    } CorrectionMode;
+
+    enum { DEFAULT_LUT_SIZE = 33, BAND_BYTES = 64 * 1024 };
+
+    typedef rbf::RBF_multi_interpolation<float, 3, 3, rbf::RBF_fn_NormShepard> Interpolator;
+    typedef rbf::RBF_sparse_interpolation<float, 3, 3, rbf::RBF_fn_Wendland> SparseInterpolator;
+
+    // Parses a mode name as given on the command line: lut, lut8, exact or rbf
+    static bool parseCorrectionMode(const char* name, CorrectionMode& mode)
+    {
+        const char* names[] = { "lut", "exact", "rbf", "lut8" };
+        const CorrectionMode modes[] = { MODE_LUT, MODE_EXACT, MODE_RBF, MODE_LUT8 };
+
+        for(int i = 0; i < 4; ++i)
+        {
+            if(0 == strcmp(name, names[i]))
+            {
+                mode = modes[i];
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // True if a lut grid of size cells per axis works in mode: the 8 bit lut needs a power
+    // of two number of cells, at most 256
+    static bool validLutSize(CorrectionMode mode, int size)
+    {
+        const bool pow2_cells = size > 2 && size <= 257 && 0 == ((size - 1) & (size - 2));
+        return size >= 2 && (MODE_LUT8 != mode || pow2_cells);
+    }
+
+    // Converts RGB correspondences (source RGB followed by target RGB, as stored in the color
+    // samples files) to the interpolator inputs: source Lab colors and target - source Lab offsets
+    static void samplesToLab(const unsigned char* rgb_pairs,
+                             int num_samples,
+                             Eigen::Matrix<float, Eigen::Dynamic, 3>& support,
+                             Eigen::Matrix<float, Eigen::Dynamic, 3>& values)
+    {
+        std::vector<float> lab(num_samples * 6);
+        color::RGBPairs_to_Lab(rgb_pairs, lab.data(), num_samples);
+
+        support.resize(num_samples, 3);
+        values.resize(num_samples, 3);
+
+        for(int i = 0; i < num_samples; ++i)
+        {
+            for(int j = 0; j < 3; ++j)
+            {
+                support(i, j) = lab[i * 6 + j];
+                values(i, j) = lab[i * 6 + j + 3] - lab[i * 6 + j];
+            }
+        }
+    }
+
+    // Fitted state of a Model given on external memory, e.g. a mapped model file. points and
+    // weights are column major, num_points x 3, and copied by the model. The luts are used in
+    // place; a null lut is baked again from the weights. backing is held by the model, to keep
+    // the lut memory alive as long as it is.
+    struct ModelData
+    {
+        CorrectionMode mode;
+        float support_radius;       // > 0 for the sparse Wendland model
+        float power;                // normalized Shepard exponent otherwise
+        bool normalize;
+
+        int num_points;
+        const float* points;
+        const float* weights;
+        rbf::FitReport report;
+
+        int lut_size;
+        const float* lut_min;       // Lab range of the MODE_LUT grid
+        const float* lut_max;
+        float* lut;                 // MODE_LUT offsets, lut_size^3 x 3 interleaved
+        int16_t* lut8;              // MODE_LUT8 offsets
+
+        std::shared_ptr<void> backing;
+    };
+
+    // Immutable once constructed, so a single instance can be shared by all the
+    // workers. The only mutable state, the exact mode color cache, is thread-safe.
+    // Images are 8 bit BGR, as loaded by OpenCV.
+
+    class Model
+    {
+    public:
+        // rgb_pairs holds num_samples correspondences: source RGB followed by target RGB,
+        // as stored in the color samples files. A support_radius > 0 (in Lab units) fits
+        // compactly supported Wendland kernels with a sparse solver instead of the dense
+        // normalized Shepard model; solver only applies to the dense model.
+        Model(const unsigned char* rgb_pairs,
+              int num_samples,
+              CorrectionMode in_mode = MODE_LUT,
+              int lut_size = DEFAULT_LUT_SIZE,
+              rbf::SolverType solver = rbf::SOLVER_LDLT,
+              float support_radius = 0.0f) : mode(in_mode)
+        {
+            {
+                PROFILE_SCOPE(TIMER_FIT);
+
+                Eigen::Matrix<float, Eigen::Dynamic, 3> support, values;
+                samplesToLab(rgb_pairs, num_samples, support, values);
+
+                if(support_radius > 0.0f)
+                    sparse.reset(new SparseInterpolator(support, values, true, rbf::RBF_fn_Wendland<float>(support_radius)));
+                else
+                    rbf.reset(new Interpolator(support, values, true, solver));
+            }
+
+            PROFILE_COUNT(COUNTER_FITS, 1);
+
+            prepare(lut_size, nullptr, nullptr, nullptr, nullptr);
+        }
+
+        // Restores a fitted model without solving. Points and weights are copied, the luts
+        // are used in place when given
+        explicit Model(const ModelData& data) : mode(data.mode), backing(data.backing)
+        {
+            if(data.support_radius > 0.0f)
+                sparse.reset(new SparseInterpolator(data.points, data.weights, data.num_points, data.normalize,
+                                                    rbf::RBF_fn_Wendland<float>(data.support_radius), data.report));
+            else
+                rbf.reset(new Interpolator(data.points, data.weights, data.num_points, data.normalize,
+                                           rbf::RBF_fn_NormShepard<float>(data.power), data.report));
+
+            prepare(data.lut_size, data.lut_min, data.lut_max, data.lut, data.lut8);
+        }
+
+        CorrectionMode correctionMode() const { return mode; }
+        // One of the two is set, depending on support_radius
+        const Interpolator* interpolator() const { return rbf.get(); }
+        const SparseInterpolator* sparseInterpolator() const { return sparse.get(); }
+        const rbf::FitReport& fitReport() const { return sparse ? sparse->fitReport() : rbf->fitReport(); }
+
+        // Lab offsets of count Lab colors, planar, from whichever interpolator was fitted
+        void interpolate(const float* const* in, float* const* out, const int count) const
+        {
+            if(sparse)
+                sparse->interpolate(in, out, count);
+            else
+                rbf->interpolate(in, out, count);
+        }
+        const color::ColorLUT3D<float>* colorLUT() const { return lut.get(); }
+        const color::ColorLUT3D8* colorLUT8() const { return lut8.get(); }
+
+        const color::RGB2Lab<float>& bgrToLab() const { return *toLab; }
+        const color::Lab2RGB<float>& labToBGR() const { return *toBGR; }
+
+        // 8 bit converters, only set in MODE_LUT8
+        const color::RGB2Lab<unsigned char>* bgrToLab8() const { return toLab8.get(); }
+        const color::Lab2RGB<unsigned char>* labToBGR8() const { return toBGR8.get(); }
+
+        // Exponential smoothing between models fitted on successive frames: moves this model's
+        // lut toward the one of target (same mode and lut size). For a fixed set of support
+        // points the correction is linear in the RBF weights, so this is the same as smoothing
+        // the weights; it also stays defined when the support points change. Only the lut modes
+        // can be smoothed. Returns the largest remaining Lab difference, or -1 if incompatible.
+        // Not thread-safe: call it between frames, not while the model is being applied.
+        float blendToward(const Model& target, float keep)
+        {
+            if(mode != target.mode)
+                return -1.0f;
+
+            if(lut && target.lut && lut->gridSize() == target.lut->gridSize())
+                return lut->blendToward(*target.lut, keep);
+
+            if(lut8 && target.lut8 && lut8->gridSize() == target.lut8->gridSize())
+                return lut8->blendToward(*target.lut8, keep);
+
+            return -1.0f;
+        }
+
+        // Exact correction of one BGR pixel through the full conversion chain
+        void correct(const unsigned char* src, unsigned char* dst) const
+        {
+            float fbgr[3], lab[3];
+
+            color::RGB255_to_RGB01(src, fbgr);
+            toLab->convert(fbgr, lab, 1);
+
+            Eigen::Matrix<float, 1, 3> offset;
+            float* in[] = { &lab[0], &lab[1], &lab[2] };
+            float* out[] = { &offset(0), &offset(1), &offset(2) };
+            interpolate(in, out, 1);
+
+            lab[0] += offset(0);
+            lab[1] += offset(1);
+            lab[2] += offset(2);
+
+            toBGR->convert(lab, fbgr, 1);
+            color::RGB01_to_RGB255(fbgr, dst);
+        }
+
+        // Exact correction of one BGR pixel, memoized. Only valid in MODE_EXACT.
+        // Returns true when the color was cached.
+        inline bool correctCached(const unsigned char* src, unsigned char* dst) const
+        {
+            struct Fn
+            {
+                const Model* model;
+                void operator()(const unsigned char* in, unsigned char* out) const { model->correct(in, out); }
+            } fn = { this };
+
+            return cache->lookup(src, dst, fn);
+        }
+
+    private:
+        Model(const Model& other);
+        Model& operator=(const Model& other);
+
+        // Converters and lut or cache of the mode; luts are baked unless cells are given
+        void prepare(int lut_size, const float* lut_min, const float* lut_max, float* lut_cells, int16_t* lut8_cells)
+        {
+            // 3 channels, blue first
+            toLab.reset(new color::RGB2Lab<float>(3, 0, nullptr, nullptr, true));
+            toBGR.reset(new color::Lab2RGB<float>(3, 0, nullptr, nullptr, true));
+
+            if(MODE_LUT == mode)
+            {
+                lut.reset(new color::ColorLUT3D<float>(lut_size, lut_min, lut_max));
+
+                if(lut_cells)
+                {
+                    lut->attach(lut_cells);
+                }
+                else
+                {
+                    PROFILE_SCOPE(TIMER_BAKE);
+                    lut->bakeInterpolator(*this);
+                }
+            }
+            else if(MODE_LUT8 == mode)
+            {
+                toLab8.reset(new color::RGB2Lab<unsigned char>(3, 0, nullptr, nullptr, true));
+                toBGR8.reset(new color::Lab2RGB<unsigned char>(3, 0, nullptr, nullptr, true));
+                lut8.reset(new color::ColorLUT3D8(lut_size));
+
+                if(lut8_cells)
+                {
+                    lut8->attach(lut8_cells);
+                }
+                else
+                {
+                    PROFILE_SCOPE(TIMER_BAKE);
+                    lut8->bakeInterpolator(*this);
+                }
+            }
+            else if(MODE_EXACT == mode)
+            {
+                cache.reset(new color::ColorCache8());
+            }
+        }
+
+        CorrectionMode mode;
+
+        std::unique_ptr<Interpolator> rbf;
+        std::unique_ptr<SparseInterpolator> sparse;
+        std::unique_ptr<color::ColorLUT3D<float> > lut;
+        std::unique_ptr<color::ColorCache8> cache;
+
+        std::unique_ptr<color::RGB2Lab<float> > toLab;
+        std::unique_ptr<color::Lab2RGB<float> > toBGR;
+
+        std::unique_ptr<color::ColorLUT3D8> lut8;
+        std::unique_ptr<color::RGB2Lab<unsigned char> > toLab8;
+        std::unique_ptr<color::Lab2RGB<unsigned char> > toBGR8;
+
+        std::shared_ptr<void> backing;
+    };
+
+    // Per worker planar buffers for one image row: L, a, b and their offsets,
+    // or the interleaved 8 bit Lab row in MODE_LUT8
+    struct RowScratch
+    {
+        std::vector<float> planes;
+        std::vector<unsigned char> lab8;
+
+        void reserve(int cols, CorrectionMode mode)
+        {
+            if(MODE_LUT8 == mode)
+                lab8.resize(cols * 3);
+            else
+                planes.resize(cols * 6);
+        }
+
+        float* plane(int i, int cols) { return &planes[i * cols]; }
+    };
+
+    // Timed per row and stage when profiling, so the clock is read a few times per row only
+    static void correctRow(const unsigned char* src, unsigned char* dst, int cols, const Model& model, RowScratch& scratch)
+    {
+        if(MODE_EXACT == model.correctionMode())
+        {
+            PROFILE_SCOPE(TIMER_EXACT);
+
+            int hits = 0;
+
+            for(int x = 0; x < cols * 3; x += 3)
+                hits += model.correctCached(&src[x], &dst[x]);
+
+            PROFILE_COUNT(COUNTER_CACHE_HITS, hits);
+            PROFILE_COUNT(COUNTER_CACHE_MISSES, cols - hits);
+            return;
+        }
+
+        if(MODE_LUT8 == model.correctionMode())
+        {
+            unsigned char* lab = &scratch.lab8[0];
+
+            {
+                PROFILE_SCOPE(TIMER_TO_LAB);
+                model.bgrToLab8()->convert(src, lab, cols);
+            }
+            {
+                PROFILE_SCOPE(TIMER_OFFSETS);
+                model.colorLUT8()->apply(lab, lab, cols);
+            }
+
+            PROFILE_SCOPE(TIMER_TO_BGR);
+            model.labToBGR8()->convert(lab, dst, cols);
+            return;
+        }
+
+        float* lab[] = { scratch.plane(0, cols), scratch.plane(1, cols), scratch.plane(2, cols) };
+        float* offset[] = { scratch.plane(3, cols), scratch.plane(4, cols), scratch.plane(5, cols) };
+
+        {
+            PROFILE_SCOPE(TIMER_TO_LAB);
+            model.bgrToLab().convertToPlanar(src, 3, lab[0], lab[1], lab[2], cols);
+        }
+        {
+            PROFILE_SCOPE(TIMER_OFFSETS);
+
+            if(MODE_LUT == model.correctionMode())
+                model.colorLUT()->interpolate(lab, offset, cols, color::LUT_TETRAHEDRAL);
+            else
+                model.interpolate(lab, offset, cols);
+
+            for(int c = 0; c < 3; ++c)
+                for(int x = 0; x < cols; ++x)
+                    lab[c][x] += offset[c][x];
+        }
+
+        PROFILE_SCOPE(TIMER_TO_BGR);
+        model.labToBGR().convertFromPlanar(lab[0], lab[1], lab[2], dst, 3, cols);
+    }
+
+    // Corrects a CV_8UC3 BGR image. The rows are split in bands of about BAND_BYTES,
+    // processed on the pool with one scratch buffer per worker, kept by the caller: once
+    // they have grown to the image width, repeated calls allocate nothing (nor does dst
+    // when it already has the size of src). src and dst may be the same image.
+    static void applyColorBalance(const cv::Mat& src, cv::Mat& dst, const Model& model, parallel::ThreadPool& pool,
+                                  std::vector<RowScratch>& scratch)
+    {
+        assert(src.depth() == CV_8U && src.channels() == 3);
+
+        if(dst.data != src.data)
+            dst.create(src.rows, src.cols, CV_8UC3);
+
+        PROFILE_COUNT(COUNTER_PIXELS, (uint64_t)src.rows * src.cols);
+
+        const int band_rows = std::max(1, (int)BAND_BYTES / std::max(1, src.cols * 3));
+        const int num_bands = (src.rows + band_rows - 1) / band_rows;
+
+        if((int)scratch.size() < pool.size())
+            scratch.resize(pool.size());
+
+        pool.run(num_bands, [&](int band, int worker)
+        {
+            RowScratch& s = scratch[worker];
+            s.reserve(src.cols, model.correctionMode());
+
+            const int last = std::min(src.rows, (band + 1) * band_rows);
+
+            for(int y = band * band_rows; y < last; ++y)
+                correctRow(src.ptr<unsigned char>(y), dst.ptr<unsigned char>(y), src.cols, model, s);
+        });
+    }
+
+    // Same as above with scratch buffers for this call only
+    static void applyColorBalance(const cv::Mat& src, cv::Mat& dst, const Model& model, parallel::ThreadPool& pool)
+    {
+        std::vector<RowScratch> scratch;
+        applyColorBalance(src, dst, model, pool, scratch);
+    }
+
+    // Same as above with a pool of num_threads workers, 0 uses the shared default pool
+    static void applyColorBalance(const cv::Mat& src, cv::Mat& dst, const Model& model, int num_threads = 0)
+    {
+        if(num_threads <= 0)
+        {
+            applyColorBalance(src, dst, model, parallel::defaultPool());
+        }
+        else
+        {
+            parallel::ThreadPool pool(num_threads);
+            applyColorBalance(src, dst, model, pool);
+        }
+    }
+
+}
+
+#endif /* balance_h */
@@ -0,0 +1,184 @@
+//
+//  benchmark.h
+//  ar-color-balancing
+//
+//  Self-contained micro benchmark harness: repeated timing, a text table and JSON output.
+//
+
+#ifndef benchmark_h
+#define benchmark_h
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+    // Keeps the compiler from dropping a computation whose result is unused
+    template<typename T>
+    inline void doNotOptimize(const T& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    struct Result
+    {
+        std::string name;
+        long iterations;
+        double mean_seconds;
+        double min_seconds;
+        double items;           // per iteration, 0 if not meaningful
+        std::string item_unit;
+
+        double itemsPerSecond() const { return min_seconds > 0.0 ? items / min_seconds : 0.0; }
+    };
+
+    // Times each benchmark for at least min_time seconds and min_iterations calls, after
+    // one discarded warm up call when a call is short. The minimum is the figure to track,
+    // the mean shows the noise. Benchmarks whose name does not contain the filter are skipped.
+    class Runner
+    {
+    public:
+        Runner() : min_time(0.5), min_iterations(3), out(stdout) { }
+
+        double min_time;
+        long min_iterations;
+        std::string filter;
+        FILE* out;              // the table of results, printed as they complete
+
+        bool enabled(const std::string& name) const
+        {
+            return filter.empty() || std::string::npos != name.find(filter);
+        }
+
+        // fn() runs one iteration processing items item_unit (e.g. pixels)
+        template<typename TFn>
+        void run(const std::string& name, double items, const char* item_unit, TFn fn)
+        {
+            if(!enabled(name))
+                return;
+
+            typedef std::chrono::steady_clock clock;
+
+            Result r;
+            r.name = name;
+            r.iterations = 0;
+            r.min_seconds = 0.0;
+            r.items = items;
+            r.item_unit = item_unit;
+
+            double total = 0.0;
+            bool warm = false;
+
+            for(;;)
+            {
+                clock::time_point start = clock::now();
+                fn();
+                const double t = std::chrono::duration<double>(clock::now() - start).count();
+
+                // warm up: caches, lazy tables and pools
+                if(!warm && t < min_time / 10)
+                {
+                    warm = true;
+                    continue;
+                }
+
+                warm = true;
+                total += t;
+                r.min_seconds = r.iterations ? std::min(r.min_seconds, t) : t;
+                ++r.iterations;
+
+                if(total >= min_time && r.iterations >= min_iterations)
+                    break;
+
+                // long calls: a single one is already measured well enough
+                if(t >= min_time)
+                    break;
+            }
+
+            r.mean_seconds = total / r.iterations;
+            results.push_back(r);
+
+            printRow(out, r);
+            fflush(out);
+        }
+
+        static void printHeader(FILE* f)
+        {
+            fprintf(f, "%-40s %10s %14s %14s %16s\n", "benchmark", "iterations", "min ms", "mean ms", "items/s");
+        }
+
+        static void printRow(FILE* f, const Result& r)
+        {
+            char rate[64] = "";
+
+            if(r.items > 0.0)
+                snprintf(rate, sizeof(rate), "%.4g %s/s", r.itemsPerSecond(), r.item_unit.c_str());
+
+            fprintf(f, "%-40s %10ld %14.4f %14.4f %16s\n", r.name.c_str(), r.iterations, r.min_seconds * 1000.0, r.mean_seconds * 1000.0, rate);
+        }
+
+        // One object with the run context (free form key / value strings) and the results
+        void writeJSON(FILE* f, const std::vector<std::pair<std::string, std::string> >& context) const
+        {
+            fprintf(f, "{\n  \"context\": {\n");
+
+            char date[32];
+            time_t now = time(nullptr);
+            strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+            fprintf(f, "    \"date\": \"%s\"", date);
+
+            for(size_t i = 0; i < context.size(); ++i)
+                fprintf(f, ",\n    \"%s\": \"%s\"", escaped(context[i].first).c_str(), escaped(context[i].second).c_str());
+
+            fprintf(f, "\n  },\n  \"benchmarks\": [");
+
+            for(size_t i = 0; i < results.size(); ++i)
+            {
+                const Result& r = results[i];
+
+                fprintf(f, "%s\n    {\"name\": \"%s\", \"iterations\": %ld, \"min_ns\": %.1f, \"mean_ns\": %.1f",
+                        i ? "," : "", escaped(r.name).c_str(), r.iterations, r.min_seconds * 1e9, r.mean_seconds * 1e9);
+
+                if(r.items > 0.0)
+                    fprintf(f, ", \"items\": %.0f, \"item_unit\": \"%s\", \"items_per_second\": %.6g",
+                            r.items, escaped(r.item_unit).c_str(), r.itemsPerSecond());
+
+                fprintf(f, "}");
+            }
+
+            fprintf(f, "\n  ]\n}\n");
+        }
+
+        const std::vector<Result>& allResults() const { return results; }
+
+    private:
+        static std::string escaped(const std::string& s)
+        {
+            std::string out;
+
+            for(size_t i = 0; i < s.size(); ++i)
+            {
+                if(s[i] == '"' || s[i] == '\\')
+                    out += '\\';
+                out += s[i];
+            }
+
+            return out;
+        }
+
+        std::vector<Result> results;
+    };
+
+}
+
+#endif /* benchmark_h */
@@ -0,0 +1,84 @@
+//
+//  colorbalancer.h
+//  ar-color-balancing
+//
+//  Public interface of the arcolorbalance library: fit a color balance from color
+//  correspondences, or load a saved one, and apply it to 8 bit BGR images.
+//
+
+#ifndef colorbalancer_h
+#define colorbalancer_h
+
+#include <memory>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace balance
+{
+    class Model;
+
+    // Holds the fitted model and the scratch buffers of its application, so once the first
+    // frame of a given size is done, apply() and applyInPlace() do no heap allocation.
+    // A model can be refit or replaced at any time between two calls. Calls on one instance
+    // must not overlap; use one instance per thread, they can share a model (see model()).
+    // The internals stay out of this header, so callers only depend on OpenCV core.
+
+    class ColorBalancer
+    {
+    public:
+        enum Mode
+        {
+            LUT,        // Lab offsets from a baked 3D lut
+            EXACT,      // full RBF evaluation, memoized per 8 bit color
+            RBF,        // full RBF evaluation of every pixel
+            LUT8,       // all integer, the fastest
+
+        };
+
+        struct Options
+        {
+            Mode mode;
+            int lut_size;           // grid size of the luts, 2^k + 1 for LUT8
+            float support_radius;   // > 0 fits compactly supported kernels (sparse solver)
+            int num_threads;        // workers of the balancer's own pool, 0 for the shared one
+
+            Options() : mode(LUT), lut_size(33), support_radius(0.0f), num_threads(0) { }
+        };
+
+        ColorBalancer();
+        explicit ColorBalancer(const Options& options);
+        ~ColorBalancer();
+
+        // rgb_pairs holds num_samples correspondences: source RGB followed by target RGB,
+        // as stored in the color samples files. False, keeping the current model, if invalid.
+        bool fit(const unsigned char* rgb_pairs, int num_samples);
+        bool fit(const std::vector<unsigned char>& rgb_pairs);
+
+        // Model files as written by save(); their mode and lut size replace the options'
+        bool load(const char* filename);
+        bool save(const char* filename) const;
+
+        bool fitted() const;
+
+        // Corrects a CV_8UC3 BGR image into dst, (re)allocated only when its size or type
+        // differs from src. False, leaving dst untouched, without a model or on another type.
+        bool apply(const cv::Mat& src, cv::Mat& dst);
+        bool applyInPlace(cv::Mat& image);
+
+        // The fitted model, for sharing between balancers or inspection through balance.h
+        std::shared_ptr<Model> model() const;
+        void setModel(const std::shared_ptr<Model>& model);
+
+        const Options& options() const;
+
+    private:
+        ColorBalancer(const ColorBalancer& other);
+        ColorBalancer& operator=(const ColorBalancer& other);
+
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+    };
+
+}
+
+#endif /* colorbalancer_h */
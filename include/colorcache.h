@@ -0,0 +1,111 @@
+//
+//  colorcache.h
+//  ar-color-balancing
+//
+//  Memoized 8 bit correction over the full 24 bit RGB input space.
+//
+
+#ifndef colorcache_h
+#define colorcache_h
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace color
+{
+    // The correction of an 8 bit pixel is pure in its byte triple, so its result
+    // can be stored once per input color. Each of the 2^24 entries packs the output
+    // triple in the low 24 bits and a valid flag in bit 31. Entries are atomics,
+    // concurrent lookups may race to fill the same entry but always write the same value.
+    // The owner must call invalidate() whenever the correction changes (e.g. on refit).
+
+    class ColorCache8
+    {
+    public:
+        enum { NUM_ENTRIES = 1 << 24 };
+        static const uint32_t VALID = 0x80000000u;
+
+        ColorCache8() : entries(new std::atomic<uint32_t>[NUM_ENTRIES])
+        {
+            invalidate();
+        }
+
+        ~ColorCache8() { delete[] entries; }
+
+        void invalidate()
+        {
+            for(int i = 0; i < NUM_ENTRIES; ++i)
+                entries[i].store(0, std::memory_order_relaxed);
+        }
+
+        // Corrects one RGB triple, calling fn(const unsigned char* src, unsigned char* dst)
+        // only the first time the color is seen. Returns true when the color was cached.
+        template<typename TFn>
+        inline bool lookup(const unsigned char* src, unsigned char* dst, TFn& fn)
+        {
+            const uint32_t key = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | (uint32_t)src[2];
+            uint32_t e = entries[key].load(std::memory_order_relaxed);
+            const bool hit = 0 != (e & VALID);
+
+            if(!hit)
+            {
+                unsigned char out[3];
+                fn(src, out);
+                e = VALID | ((uint32_t)out[0] << 16) | ((uint32_t)out[1] << 8) | (uint32_t)out[2];
+                entries[key].store(e, std::memory_order_relaxed);
+            }
+
+            dst[0] = (unsigned char)(e >> 16);
+            dst[1] = (unsigned char)(e >> 8);
+            dst[2] = (unsigned char)e;
+
+            return hit;
+        }
+
+        // Builds the whole table up front, splitting the input space across num_threads.
+        // fn must be safe to call concurrently.
+        template<typename TFn>
+        void fill(TFn fn, int num_threads = 0)
+        {
+            if(num_threads <= 0)
+                num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+            const int chunk = (NUM_ENTRIES + num_threads - 1) / num_threads;
+            std::vector<std::thread> workers;
+
+            for(int t = 0; t < num_threads; ++t)
+            {
+                workers.push_back(std::thread([this, &fn, t, chunk]()
+                {
+                    unsigned char in[3], out[3];
+                    const int last = std::min((t + 1) * chunk, (int)NUM_ENTRIES);
+
+                    for(int key = t * chunk; key < last; ++key)
+                    {
+                        in[0] = (unsigned char)(key >> 16);
+                        in[1] = (unsigned char)(key >> 8);
+                        in[2] = (unsigned char)key;
+                        fn(in, out);
+                        entries[key].store(VALID | ((uint32_t)out[0] << 16) | ((uint32_t)out[1] << 8) | (uint32_t)out[2],
+                                           std::memory_order_relaxed);
+                    }
+                }));
+            }
+
+            for(size_t t = 0; t < workers.size(); ++t)
+                workers[t].join();
+        }
+
+    private:
+        ColorCache8(const ColorCache8& other);
+        ColorCache8& operator=(const ColorCache8& other);
+
+        std::atomic<uint32_t>* entries;
+    };
+
+}
+
+#endif /* colorcache_h */
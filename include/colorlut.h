@@ -0,0 +1,405 @@
+//
+//  colorlut.h
+//  ar-color-balancing
+//
+//  3D lookup table baking a Lab -> Lab correction on a regular grid.
+//
+
+#ifndef colorlut_h
+#define colorlut_h
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdint.h>
+
+namespace color
+{
+    typedef enum LUTInterpolation
+    {
+        LUT_TRILINEAR,
+        LUT_TETRAHEDRAL,
+
+    } LUTInterpolation;
+
+    // Range of the Lab space covered by default by a lut
+    static const float LabLUTMin[] = { 0.0f, -128.0f, -128.0f };
+    static const float LabLUTMax[] = { 100.0f, 127.0f, 127.0f };
+
+    // Samples a 3 channel correction once on a size^3 grid, so that evaluation
+    // cost no longer depends on how expensive the correction is.
+    // Stored values are offsets: corrected = src + interpolate(src)
+
+    template<typename T>
+    class ColorLUT3D
+    {
+    public:
+        ColorLUT3D(int in_size,
+                   const T* in_min = nullptr,
+                   const T* in_max = nullptr) : size(in_size)
+        {
+            assert(size >= 2);
+
+            for(int c = 0; c < 3; ++c)
+            {
+                lo[c] = in_min ? in_min[c] : (T)LabLUTMin[c];
+                hi[c] = in_max ? in_max[c] : (T)LabLUTMax[c];
+                step[c] = (hi[c] - lo[c]) / (T)(size - 1);
+                inv_step[c] = (T)1 / step[c];
+            }
+
+            table.assign(size * size * size * 3, (T)0);
+            cells = &table[0];
+        }
+
+        // Evaluates fn(const T* in, T* out) at every grid node.
+        template<typename TFn>
+        void bake(TFn fn)
+        {
+            T in[3];
+
+            for(int i = 0; i < size; ++i)
+            {
+                in[0] = lo[0] + i * step[0];
+
+                for(int j = 0; j < size; ++j)
+                {
+                    in[1] = lo[1] + j * step[1];
+
+                    for(int k = 0; k < size; ++k)
+                    {
+                        in[2] = lo[2] + k * step[2];
+                        fn(in, &cells[node(i, j, k)]);
+                    }
+                }
+            }
+        }
+
+        // Bakes a 3 output interpolator (rbf::RBF_multi_interpolation) with one batch
+        // evaluation over all the grid nodes
+        template<typename TRBF>
+        void bakeInterpolator(const TRBF& rbf)
+        {
+            const int count = size * size * size;
+            std::vector<T> coords(count * 3), offsets(count * 3);
+
+            T* in[] = { &coords[0], &coords[count], &coords[2 * count] };
+            T* out[] = { &offsets[0], &offsets[count], &offsets[2 * count] };
+
+            for(int i = 0, s = 0; i < size; ++i)
+                for(int j = 0; j < size; ++j)
+                    for(int k = 0; k < size; ++k, ++s)
+                    {
+                        in[0][s] = lo[0] + i * step[0];
+                        in[1][s] = lo[1] + j * step[1];
+                        in[2][s] = lo[2] + k * step[2];
+                    }
+
+            rbf.interpolate(in, out, count);
+
+            for(int s = 0; s < count; ++s)
+            {
+                cells[s * 3 + 0] = out[0][s];
+                cells[s * 3 + 1] = out[1][s];
+                cells[s * 3 + 2] = out[2][s];
+            }
+        }
+
+        // Writes the interpolated offsets of n interleaved samples. dst must be already allocated
+        void interpolate(const T* src, T* dst, const int n, LUTInterpolation mode = LUT_TETRAHEDRAL) const
+        {
+            for(int s = 0; s < n * 3; s += 3)
+            {
+                lookup(src[s], src[s + 1], src[s + 2], &dst[s], mode);
+            }
+        }
+
+        // Same on planar data: in and out hold one array of n values per channel
+        void interpolate(const T* const* in, T* const* out, const int n, LUTInterpolation mode = LUT_TETRAHEDRAL) const
+        {
+            T offset[3];
+
+            for(int s = 0; s < n; ++s)
+            {
+                lookup(in[0][s], in[1][s], in[2][s], offset, mode);
+
+                out[0][s] = offset[0];
+                out[1][s] = offset[1];
+                out[2][s] = offset[2];
+            }
+        }
+
+        // Moves the table toward target (same grid) as table = keep * table + (1 - keep) * target.
+        // Returns the largest remaining difference, for exponential smoothing over time.
+        T blendToward(const ColorLUT3D& target, T keep)
+        {
+            assert(target.size == size);
+            T remaining = 0;
+
+            for(size_t i = 0; i < entries(); ++i)
+            {
+                cells[i] = keep * cells[i] + (1 - keep) * target.cells[i];
+                remaining = std::max(remaining, std::abs(target.cells[i] - cells[i]));
+            }
+
+            return remaining;
+        }
+
+        int gridSize() const { return size; }
+        const T* data() const { return cells; }
+        const T* rangeMin() const { return lo; }
+        const T* rangeMax() const { return hi; }
+        size_t entries() const { return (size_t)size * size * size * 3; }
+
+        // Switches to external storage of entries() values, e.g. a mapped model file, which
+        // must outlive the lut. The contents are taken as they are, not baked.
+        void attach(T* external)
+        {
+            cells = external;
+            std::vector<T>().swap(table);
+        }
+
+    private:
+        ColorLUT3D(const ColorLUT3D& other);
+        ColorLUT3D& operator=(const ColorLUT3D& other);
+
+        inline void lookup(T x0, T x1, T x2, T* out, LUTInterpolation mode) const
+        {
+            const T src[] = { x0, x1, x2 };
+            int idx[3];
+            T f[3];
+
+            for(int c = 0; c < 3; ++c)
+            {
+                T x = (src[c] - lo[c]) * inv_step[c];
+                x = std::min(std::max(x, (T)0), (T)(size - 1));
+                idx[c] = std::min((int)x, size - 2);
+                f[c] = x - (T)idx[c];
+            }
+
+            if(LUT_TRILINEAR == mode)
+                trilinear(idx, f, out);
+            else
+                tetrahedral(idx, f, out);
+        }
+
+        inline int node(int i, int j, int k) const
+        {
+            return ((i * size + j) * size + k) * 3;
+        }
+
+        void trilinear(const int* idx, const T* f, T* out) const
+        {
+            const int dx = size * size * 3, dy = size * 3, dz = 3;
+            const T* c000 = &cells[node(idx[0], idx[1], idx[2])];
+
+            for(int c = 0; c < 3; ++c)
+            {
+                T c00 = c000[c]           + f[2] * (c000[dz + c]           - c000[c]);
+                T c01 = c000[dy + c]      + f[2] * (c000[dy + dz + c]      - c000[dy + c]);
+                T c10 = c000[dx + c]      + f[2] * (c000[dx + dz + c]      - c000[dx + c]);
+                T c11 = c000[dx + dy + c] + f[2] * (c000[dx + dy + dz + c] - c000[dx + dy + c]);
+
+                T c0 = c00 + f[1] * (c01 - c00);
+                T c1 = c10 + f[1] * (c11 - c10);
+
+                out[c] = c0 + f[0] * (c1 - c0);
+            }
+        }
+
+        // Splits the cell in 6 tetrahedra along the main diagonal, 4 taps instead of 8
+        void tetrahedral(const int* idx, const T* f, T* out) const
+        {
+            const int dx = size * size * 3, dy = size * 3, dz = 3;
+            const T* c000 = &cells[node(idx[0], idx[1], idx[2])];
+            const T fx = f[0], fy = f[1], fz = f[2];
+
+            int o1, o2;
+            T w0, w1, w2, w3;
+
+            if(fx >= fy)
+            {
+                if(fy >= fz)      { o1 = dx; o2 = dx + dy; w0 = 1 - fx; w1 = fx - fy; w2 = fy - fz; w3 = fz; }
+                else if(fx >= fz) { o1 = dx; o2 = dx + dz; w0 = 1 - fx; w1 = fx - fz; w2 = fz - fy; w3 = fy; }
+                else              { o1 = dz; o2 = dx + dz; w0 = 1 - fz; w1 = fz - fx; w2 = fx - fy; w3 = fy; }
+            }
+            else
+            {
+                if(fx >= fz)      { o1 = dy; o2 = dx + dy; w0 = 1 - fy; w1 = fy - fx; w2 = fx - fz; w3 = fz; }
+                else if(fy >= fz) { o1 = dy; o2 = dy + dz; w0 = 1 - fy; w1 = fy - fz; w2 = fz - fx; w3 = fx; }
+                else              { o1 = dz; o2 = dy + dz; w0 = 1 - fz; w1 = fz - fy; w2 = fy - fx; w3 = fx; }
+            }
+
+            const int o3 = dx + dy + dz;
+
+            for(int c = 0; c < 3; ++c)
+            {
+                out[c] = w0 * c000[c] + w1 * c000[o1 + c] + w2 * c000[o2 + c] + w3 * c000[o3 + c];
+            }
+        }
+
+        int size;
+        T lo[3];
+        T hi[3];
+        T step[3];
+        T inv_step[3];
+
+        std::vector<T> table;
+        T* cells;               // table, or external storage
+    };
+
+    // Integer counterpart of ColorLUT3D for the 8 bit pipeline. Input and output are 8 bit Lab
+    // as produced by RGB2Lab<unsigned char> (L*255/100, a+128, b+128). The grid spans [0, 256]
+    // in (size - 1) cells of a power of two width, so the cell index and the fraction are a
+    // shift and a mask. Offsets are stored as int16 with OFFSET_BITS fractional bits, and
+    // interpolated tetrahedrally with integer weights.
+
+    class ColorLUT3D8
+    {
+    public:
+        enum { OFFSET_BITS = 4 };
+
+        // in_size - 1 must be a power of two in [2, 256], e.g. 17 or 33
+        explicit ColorLUT3D8(int in_size) : size(in_size), shift(0)
+        {
+            assert(size >= 3 && size <= 257);
+
+            while((size - 1) << shift < 256)
+                ++shift;
+
+            assert((size - 1) << shift == 256);
+
+            table.assign(size * size * size * 3, 0);
+            cells = &table[0];
+        }
+
+        // Bakes a 3 output interpolator working on float Lab, as ColorLUT3D::bakeInterpolator
+        template<typename TRBF>
+        void bakeInterpolator(const TRBF& rbf)
+        {
+            const int count = size * size * size;
+            const int cell = 1 << shift;
+            std::vector<float> coords(count * 3), offsets(count * 3);
+
+            float* in[] = { &coords[0], &coords[count], &coords[2 * count] };
+            float* out[] = { &offsets[0], &offsets[count], &offsets[2 * count] };
+
+            for(int i = 0, s = 0; i < size; ++i)
+                for(int j = 0; j < size; ++j)
+                    for(int k = 0; k < size; ++k, ++s)
+                    {
+                        in[0][s] = (float)(i * cell) * (100.0f / 255.0f);
+                        in[1][s] = (float)(j * cell - 128);
+                        in[2][s] = (float)(k * cell - 128);
+                    }
+
+            rbf.interpolate(in, out, count);
+
+            const float scale[] = { (255.0f / 100.0f) * (1 << OFFSET_BITS), (float)(1 << OFFSET_BITS), (float)(1 << OFFSET_BITS) };
+
+            for(int s = 0; s < count; ++s)
+            {
+                for(int c = 0; c < 3; ++c)
+                {
+                    float v = out[c][s] * scale[c];
+                    v = std::min(std::max(v, -32768.0f), 32767.0f);
+                    cells[s * 3 + c] = (int16_t)(v < 0 ? v - 0.5f : v + 0.5f);
+                }
+            }
+        }
+
+        // Adds the interpolated offsets to n interleaved 8 bit Lab samples, saturating.
+        // src and dst may be the same buffer.
+        void apply(const unsigned char* src, unsigned char* dst, const int n) const
+        {
+            const int dx = size * size * 3, dy = size * 3, dz = 3;
+            const int mask = (1 << shift) - 1;
+            const int wshift = shift + OFFSET_BITS;
+            const int half = 1 << (wshift - 1);
+
+            for(int s = 0; s < n * 3; s += 3)
+            {
+                const int x0 = src[s], x1 = src[s + 1], x2 = src[s + 2];
+                const int fx = x0 & mask, fy = x1 & mask, fz = x2 & mask;
+                const int16_t* c000 = &cells[node(x0 >> shift, x1 >> shift, x2 >> shift)];
+
+                int o1, o2, w0, w1, w2, w3;
+
+                if(fx >= fy)
+                {
+                    if(fy >= fz)      { o1 = dx; o2 = dx + dy; w0 = mask + 1 - fx; w1 = fx - fy; w2 = fy - fz; w3 = fz; }
+                    else if(fx >= fz) { o1 = dx; o2 = dx + dz; w0 = mask + 1 - fx; w1 = fx - fz; w2 = fz - fy; w3 = fy; }
+                    else              { o1 = dz; o2 = dx + dz; w0 = mask + 1 - fz; w1 = fz - fx; w2 = fx - fy; w3 = fy; }
+                }
+                else
+                {
+                    if(fx >= fz)      { o1 = dy; o2 = dx + dy; w0 = mask + 1 - fy; w1 = fy - fx; w2 = fx - fz; w3 = fz; }
+                    else if(fy >= fz) { o1 = dy; o2 = dy + dz; w0 = mask + 1 - fy; w1 = fy - fz; w2 = fz - fx; w3 = fx; }
+                    else              { o1 = dz; o2 = dy + dz; w0 = mask + 1 - fz; w1 = fz - fy; w2 = fy - fx; w3 = fx; }
+                }
+
+                const int o3 = dx + dy + dz;
+
+                for(int c = 0; c < 3; ++c)
+                {
+                    int acc = w0 * c000[c] + w1 * c000[o1 + c] + w2 * c000[o2 + c] + w3 * c000[o3 + c];
+                    int v = src[s + c] + ((acc + half) >> wshift);
+                    dst[s + c] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+                }
+            }
+        }
+
+        // Integer counterpart of ColorLUT3D::blendToward. Every entry moves by at least one
+        // unit while it differs from target, so repeated calls always converge. Returns the
+        // largest remaining difference in Lab8 units.
+        float blendToward(const ColorLUT3D8& target, float keep)
+        {
+            assert(target.size == size);
+            int remaining = 0;
+
+            for(size_t i = 0; i < entries(); ++i)
+            {
+                const int d = target.cells[i] - cells[i];
+                int step = (int)(d * (1.0f - keep) + (d < 0 ? -0.5f : 0.5f));
+
+                if(0 == step && 0 != d)
+                    step = d < 0 ? -1 : 1;
+
+                cells[i] = (int16_t)(cells[i] + step);
+                remaining = std::max(remaining, std::abs(d - step));
+            }
+
+            return (float)remaining / (1 << OFFSET_BITS);
+        }
+
+        int gridSize() const { return size; }
+        const int16_t* data() const { return cells; }
+        size_t entries() const { return (size_t)size * size * size * 3; }
+
+        // Same as ColorLUT3D::attach
+        void attach(int16_t* external)
+        {
+            cells = external;
+            std::vector<int16_t>().swap(table);
+        }
+
+    private:
+        ColorLUT3D8(const ColorLUT3D8& other);
+        ColorLUT3D8& operator=(const ColorLUT3D8& other);
+
+        inline int node(int i, int j, int k) const
+        {
+            return ((i * size + j) * size + k) * 3;
+        }
+
+        int size;
+        int shift;
+
+        std::vector<int16_t> table;
+        int16_t* cells;         // table, or external storage
+    };
+
+}
+
+#endif /* colorlut_h */
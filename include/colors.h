@@ -9,7 +9,16 @@
 #ifndef colors_h
 #define colors_h
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
 #include <mathext.h>
+#include <simd.h>
 
 #define FLOAT_COLOR_CHANNEL_MAX 1.0f
 
@@ -41,8 +50,10 @@ namespace color
         IColorConversion() { }
         virtual ~IColorConversion() { }
         
-        // applies color conversion on n samples. dst must be already allocated
-        virtual void convert(const T* src, T* dst, const int n) = 0;
+        // applies color conversion on n samples. dst must be already allocated.
+        // Converters are immutable after construction: convert() is const and only reads
+        // the coefficients and the shared tables, so one instance can serve many threads.
+        virtual void convert(const T* src, T* dst, const int n) const = 0;
         
     };
     
@@ -92,44 +103,370 @@ namespace color
     
     static ushort LabCbrtTab_b[LAB_CBRT_TAB_SIZE_B];
     
+    // Fixed point Lab -> RGB: values in [0, 1] are scaled by 1 << lab_base_shift
+    #define lab_base_shift 14
+    #define INV_GAMMA_TAB_SIZE_B ((1 << lab_base_shift) + 1)
+    
+    static int LabToYF_b[256*2];
+    static int LabAToF_b[256], LabBToF_b[256];
+    static unsigned char sRGBInvGammaTab_b[INV_GAMMA_TAB_SIZE_B], linearInvGammaTab_b[INV_GAMMA_TAB_SIZE_B];
+    
+    static void buildLabTabs()
+    {
+        float f[LAB_CBRT_TAB_SIZE+1], g[GAMMA_TAB_SIZE+1], ig[GAMMA_TAB_SIZE+1], scale = 1.f/LabCbrtTabScale;
+        int i;
+        for(i = 0; i <= LAB_CBRT_TAB_SIZE; i++)
+        {
+            float x = i*scale;
+            f[i] = x < 0.008856f ? x*7.787f + 0.13793103448275862f : mathext::cubeRoot(x);
+        }
+        
+        mathext::splineBuild(f, LAB_CBRT_TAB_SIZE, LabCbrtTab);
+        
+        scale = 1.f/GammaTabScale;
+        for(i = 0; i <= GAMMA_TAB_SIZE; i++)
+        {
+            float x = i*scale;
+            g[i] = x <= 0.04045f ? x*(1.f/12.92f) : (float)std::pow((double)(x + 0.055)*(1./1.055), 2.4);
+            ig[i] = x <= 0.0031308 ? x*12.92f : (float)(1.055*std::pow((double)x, 1./2.4) - 0.055);
+        }
+        mathext::splineBuild(g, GAMMA_TAB_SIZE, sRGBGammaTab);
+        mathext::splineBuild(ig, GAMMA_TAB_SIZE, sRGBInvGammaTab);
+        
+        for(i = 0; i < 256; i++)
+        {
+            float x = i*(1.f/255.f);
+            sRGBGammaTab_b[i] = mathext::saturate_cast<unsigned short>(255.f*(1 << gamma_shift)*(x <= 0.04045f ? x*(1.f/12.92f) : (float)std::pow((double)(x + 0.055)*(1./1.055), 2.4)));
+            linearGammaTab_b[i] = (ushort)(i*(1 << gamma_shift));
+        }
+        
+        for(i = 0; i < LAB_CBRT_TAB_SIZE_B; i++)
+        {
+            float x = i*(1.f/(255.f*(1 << gamma_shift)));
+            LabCbrtTab_b[i] = mathext::saturate_cast<unsigned short>((1 << lab_shift2)*(x < 0.008856f ? x*7.787f + 0.13793103448275862f : mathext::cubeRoot(x)));
+        }
+        
+        const float base = (float)(1 << lab_base_shift);
+        
+        for(i = 0; i < 256; i++)
+        {
+            float L = i*(100.f/255.f), y, fy;
+            if(L <= 0.008856f*903.3f)
+            {
+                y = L/903.3f;
+                fy = 7.787f*y + 16.0f/116.0f;
+            }
+            else
+            {
+                fy = (L + 16.0f)/116.0f;
+                y = fy*fy*fy;
+            }
+            
+            LabToYF_b[i*2] = (int)std::round(y*base);
+            LabToYF_b[i*2+1] = (int)std::round(fy*base);
+            LabAToF_b[i] = (int)std::round((i - 128)*base/500.0f);
+            LabBToF_b[i] = (int)std::round((i - 128)*base/200.0f);
+        }
+        
+        for(i = 0; i < INV_GAMMA_TAB_SIZE_B; i++)
+        {
+            double x = i/(double)base;
+            sRGBInvGammaTab_b[i] = mathext::saturate_cast<unsigned char>(255.*(x <= 0.0031308 ? x*12.92 : 1.055*std::pow(x, 1./2.4) - 0.055));
+            linearInvGammaTab_b[i] = mathext::saturate_cast<unsigned char>(255.*x);
+        }
+    }
+    
+    // Builds the shared tables once. Thread-safe: relies on the C++11 guarantee that
+    // a function local static is initialized exactly once.
     static void initLabTabs()
     {
-        static bool initialized = false;
-        if(!initialized)
+        static const bool initialized = (buildLabTabs(), true);
+        (void)initialized;
+    }
+    
+    // Row kernels shared by the float converters. Rows are planar; the scalar forms are the
+    // reference, the vector forms use cbrt_ps / fastPow_ps in place of std::pow and the gamma
+    // spline, and are picked at runtime from simd::level().
+    
+    namespace detail
+    {
+        static inline void linearToLab(const float* c, float R, float G, float B, float& L, float& a, float& b)
+        {
+            static const float _1_3 = 1.0f / 3.0f;
+            static const float _a = 16.0f / 116.0f;
+            
+            float X = R*c[0] + G*c[1] + B*c[2];
+            float Y = R*c[3] + G*c[4] + B*c[5];
+            float Z = R*c[6] + G*c[7] + B*c[8];
+            
+            float FX = X > 0.008856f ? std::pow(X, _1_3) : (7.787f * X + _a);
+            float FY = Y > 0.008856f ? std::pow(Y, _1_3) : (7.787f * Y + _a);
+            float FZ = Z > 0.008856f ? std::pow(Z, _1_3) : (7.787f * Z + _a);
+            
+            L = Y > 0.008856f ? (116.f * FY - 16.f) : (903.3f * Y);
+            a = 500.f * (FX - FY);
+            b = 200.f * (FY - FZ);
+        }
+        
+        static inline void labToRGB01(const float* c, bool srgb, float li, float ai, float bi, float& r, float& g, float& b)
         {
-            float f[LAB_CBRT_TAB_SIZE+1], g[GAMMA_TAB_SIZE+1], ig[GAMMA_TAB_SIZE+1], scale = 1.f/LabCbrtTabScale;
-            int i;
-            for(i = 0; i <= LAB_CBRT_TAB_SIZE; i++)
+            static const float lThresh = 0.008856f * 903.3f;
+            static const float fThresh = 7.787f * 0.008856f + 16.0f / 116.0f;
+            
+            float y, fy;
+            if (li <= lThresh)
+            {
+                y = li / 903.3f;
+                fy = 7.787f * y + 16.0f / 116.0f;
+            }
+            else
+            {
+                fy = (li + 16.0f) / 116.0f;
+                y = fy * fy * fy;
+            }
+            
+            float fxz[] = { ai / 500.0f + fy, fy - bi / 200.0f };
+            
+            for (int j = 0; j < 2; j++)
+                if (fxz[j] <= fThresh)
+                    fxz[j] = (fxz[j] - 16.0f / 116.0f) / 7.787f;
+                else
+                    fxz[j] = fxz[j] * fxz[j] * fxz[j];
+            
+            
+            float x = fxz[0], z = fxz[1];
+            float ro = c[0] * x + c[1] * y + c[2] * z;
+            float go = c[3] * x + c[4] * y + c[5] * z;
+            float bo = c[6] * x + c[7] * y + c[8] * z;
+            
+            ro = MATHEXT_CLIP(ro);
+            go = MATHEXT_CLIP(go);
+            bo = MATHEXT_CLIP(bo);
+            
+            if (srgb)
             {
-                float x = i*scale;
-                f[i] = x < 0.008856f ? x*7.787f + 0.13793103448275862f : mathext::cubeRoot(x);
+                ro = mathext::splineInterpolate(ro * GammaTabScale, sRGBInvGammaTab, GAMMA_TAB_SIZE);
+                go = mathext::splineInterpolate(go * GammaTabScale, sRGBInvGammaTab, GAMMA_TAB_SIZE);
+                bo = mathext::splineInterpolate(bo * GammaTabScale, sRGBInvGammaTab, GAMMA_TAB_SIZE);
             }
             
-            mathext::splineBuild(f, LAB_CBRT_TAB_SIZE, LabCbrtTab);
+            r = ro, g = go, b = bo;
+        }
+        
+#if ARCB_SIMD_X86
+        
+        // Lab companding f(t) of 4 values
+        static inline __m128 labF_sse(__m128 t)
+        {
+            const __m128 thresh = _mm_set1_ps(0.008856f);
+            __m128 cube = simd::sse::cbrt_ps(_mm_max_ps(t, thresh));
+            __m128 lin = _mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(7.787f)), _mm_set1_ps(16.0f / 116.0f));
+            __m128 m = _mm_cmpgt_ps(t, thresh);
+            return _mm_or_ps(_mm_and_ps(m, cube), _mm_andnot_ps(m, lin));
+        }
+        
+        // Inverse of labF_sse
+        static inline __m128 labFInv_sse(__m128 f)
+        {
+            __m128 cube = _mm_mul_ps(_mm_mul_ps(f, f), f);
+            __m128 lin = _mm_mul_ps(_mm_sub_ps(f, _mm_set1_ps(16.0f / 116.0f)), _mm_set1_ps(1.0f / 7.787f));
+            __m128 m = _mm_cmple_ps(f, _mm_set1_ps(7.787f * 0.008856f + 16.0f / 116.0f));
+            return _mm_or_ps(_mm_and_ps(m, lin), _mm_andnot_ps(m, cube));
+        }
+        
+        // Clip to [0, 1] and sRGB gamma encode
+        static inline __m128 gammaEncode_sse(__m128 v, bool srgb)
+        {
+            v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+            
+            if (!srgb)
+                return v;
+            
+            const __m128 thresh = _mm_set1_ps(0.0031308f);
+            __m128 p = simd::sse::fastPow_ps(_mm_max_ps(v, thresh), _mm_set1_ps(1.0f / 2.4f));
+            p = _mm_sub_ps(_mm_mul_ps(p, _mm_set1_ps(1.055f)), _mm_set1_ps(0.055f));
+            __m128 m = _mm_cmple_ps(v, thresh);
+            return _mm_or_ps(_mm_and_ps(m, _mm_mul_ps(v, _mm_set1_ps(12.92f))), _mm_andnot_ps(m, p));
+        }
+        
+        // Return the number of pixels done, the caller finishes the tail
+        static inline int linearToLabSSE(const float* c, const float* R, const float* G, const float* B,
+                                         float* L, float* a, float* b, const int n)
+        {
+            int i = 0;
             
-            scale = 1.f/GammaTabScale;
-            for(i = 0; i <= GAMMA_TAB_SIZE; i++)
+            for (; i + 4 <= n; i += 4)
             {
-                float x = i*scale;
-                g[i] = x <= 0.04045f ? x*(1.f/12.92f) : (float)std::pow((double)(x + 0.055)*(1./1.055), 2.4);
-                ig[i] = x <= 0.0031308 ? x*12.92f : (float)(1.055*std::pow((double)x, 1./2.4) - 0.055);
+                __m128 r = _mm_loadu_ps(R + i), g = _mm_loadu_ps(G + i), bl = _mm_loadu_ps(B + i);
+                
+                __m128 X = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(c[0])), _mm_mul_ps(g, _mm_set1_ps(c[1]))), _mm_mul_ps(bl, _mm_set1_ps(c[2])));
+                __m128 Y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(c[3])), _mm_mul_ps(g, _mm_set1_ps(c[4]))), _mm_mul_ps(bl, _mm_set1_ps(c[5])));
+                __m128 Z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(c[6])), _mm_mul_ps(g, _mm_set1_ps(c[7]))), _mm_mul_ps(bl, _mm_set1_ps(c[8])));
+                
+                __m128 FX = labF_sse(X), FY = labF_sse(Y), FZ = labF_sse(Z);
+                
+                __m128 m = _mm_cmpgt_ps(Y, _mm_set1_ps(0.008856f));
+                __m128 l = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_mul_ps(FY, _mm_set1_ps(116.0f)), _mm_set1_ps(16.0f))),
+                                     _mm_andnot_ps(m, _mm_mul_ps(Y, _mm_set1_ps(903.3f))));
+                
+                _mm_storeu_ps(L + i, l);
+                _mm_storeu_ps(a + i, _mm_mul_ps(_mm_sub_ps(FX, FY), _mm_set1_ps(500.0f)));
+                _mm_storeu_ps(b + i, _mm_mul_ps(_mm_sub_ps(FY, FZ), _mm_set1_ps(200.0f)));
             }
-            mathext::splineBuild(g, GAMMA_TAB_SIZE, sRGBGammaTab);
-            mathext::splineBuild(ig, GAMMA_TAB_SIZE, sRGBInvGammaTab);
             
-            for(i = 0; i < 256; i++)
+            return i;
+        }
+        
+        static inline int labToRGB01SSE(const float* c, bool srgb, const float* L, const float* a, const float* b,
+                                        float* R, float* G, float* B, const int n)
+        {
+            int i = 0;
+            
+            for (; i + 4 <= n; i += 4)
             {
-                float x = i*(1.f/255.f);
-                sRGBGammaTab_b[i] = mathext::saturate_cast<unsigned short>(255.f*(1 << gamma_shift)*(x <= 0.04045f ? x*(1.f/12.92f) : (float)std::pow((double)(x + 0.055)*(1./1.055), 2.4)));
-                linearGammaTab_b[i] = (ushort)(i*(1 << gamma_shift));
+                __m128 l = _mm_loadu_ps(L + i);
+                
+                __m128 fy = _mm_mul_ps(_mm_add_ps(l, _mm_set1_ps(16.0f)), _mm_set1_ps(1.0f / 116.0f));
+                __m128 ylin = _mm_mul_ps(l, _mm_set1_ps(1.0f / 903.3f));
+                __m128 m = _mm_cmple_ps(l, _mm_set1_ps(0.008856f * 903.3f));
+                __m128 y = _mm_or_ps(_mm_and_ps(m, ylin), _mm_andnot_ps(m, _mm_mul_ps(_mm_mul_ps(fy, fy), fy)));
+                fy = _mm_or_ps(_mm_and_ps(m, _mm_add_ps(_mm_mul_ps(ylin, _mm_set1_ps(7.787f)), _mm_set1_ps(16.0f / 116.0f))),
+                               _mm_andnot_ps(m, fy));
+                
+                __m128 x = labFInv_sse(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_set1_ps(1.0f / 500.0f)), fy));
+                __m128 z = labFInv_sse(_mm_sub_ps(fy, _mm_mul_ps(_mm_loadu_ps(b + i), _mm_set1_ps(1.0f / 200.0f))));
+                
+                __m128 ro = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(c[0])), _mm_mul_ps(y, _mm_set1_ps(c[1]))), _mm_mul_ps(z, _mm_set1_ps(c[2])));
+                __m128 go = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(c[3])), _mm_mul_ps(y, _mm_set1_ps(c[4]))), _mm_mul_ps(z, _mm_set1_ps(c[5])));
+                __m128 bo = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(c[6])), _mm_mul_ps(y, _mm_set1_ps(c[7]))), _mm_mul_ps(z, _mm_set1_ps(c[8])));
+                
+                _mm_storeu_ps(R + i, gammaEncode_sse(ro, srgb));
+                _mm_storeu_ps(G + i, gammaEncode_sse(go, srgb));
+                _mm_storeu_ps(B + i, gammaEncode_sse(bo, srgb));
             }
             
-            for(i = 0; i < LAB_CBRT_TAB_SIZE_B; i++)
+            return i;
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 labF_avx2(__m256 t)
+        {
+            const __m256 thresh = _mm256_set1_ps(0.008856f);
+            __m256 cube = simd::avx2::cbrt_ps(_mm256_max_ps(t, thresh));
+            __m256 lin = _mm256_fmadd_ps(t, _mm256_set1_ps(7.787f), _mm256_set1_ps(16.0f / 116.0f));
+            return _mm256_blendv_ps(lin, cube, _mm256_cmp_ps(t, thresh, _CMP_GT_OQ));
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 labFInv_avx2(__m256 f)
+        {
+            __m256 cube = _mm256_mul_ps(_mm256_mul_ps(f, f), f);
+            __m256 lin = _mm256_mul_ps(_mm256_sub_ps(f, _mm256_set1_ps(16.0f / 116.0f)), _mm256_set1_ps(1.0f / 7.787f));
+            return _mm256_blendv_ps(cube, lin, _mm256_cmp_ps(f, _mm256_set1_ps(7.787f * 0.008856f + 16.0f / 116.0f), _CMP_LE_OQ));
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 gammaEncode_avx2(__m256 v, bool srgb)
+        {
+            v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+            
+            if (!srgb)
+                return v;
+            
+            const __m256 thresh = _mm256_set1_ps(0.0031308f);
+            __m256 p = simd::avx2::fastPow_ps(_mm256_max_ps(v, thresh), _mm256_set1_ps(1.0f / 2.4f));
+            p = _mm256_fmsub_ps(p, _mm256_set1_ps(1.055f), _mm256_set1_ps(0.055f));
+            return _mm256_blendv_ps(p, _mm256_mul_ps(v, _mm256_set1_ps(12.92f)), _mm256_cmp_ps(v, thresh, _CMP_LE_OQ));
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 dot3_avx2(__m256 x, __m256 y, __m256 z, const float* c)
+        {
+            return _mm256_fmadd_ps(z, _mm256_set1_ps(c[2]), _mm256_fmadd_ps(y, _mm256_set1_ps(c[1]), _mm256_mul_ps(x, _mm256_set1_ps(c[0]))));
+        }
+        
+        ARCB_TARGET_AVX2 static inline int linearToLabAVX2(const float* c, const float* R, const float* G, const float* B,
+                                                           float* L, float* a, float* b, const int n)
+        {
+            int i = 0;
+            
+            for (; i + 8 <= n; i += 8)
             {
-                float x = i*(1.f/(255.f*(1 << gamma_shift)));
-                LabCbrtTab_b[i] = mathext::saturate_cast<unsigned short>((1 << lab_shift2)*(x < 0.008856f ? x*7.787f + 0.13793103448275862f : mathext::cubeRoot(x)));
+                __m256 r = _mm256_loadu_ps(R + i), g = _mm256_loadu_ps(G + i), bl = _mm256_loadu_ps(B + i);
+                
+                __m256 Y = dot3_avx2(r, g, bl, c + 3);
+                __m256 FX = labF_avx2(dot3_avx2(r, g, bl, c));
+                __m256 FY = labF_avx2(Y);
+                __m256 FZ = labF_avx2(dot3_avx2(r, g, bl, c + 6));
+                
+                __m256 l = _mm256_blendv_ps(_mm256_mul_ps(Y, _mm256_set1_ps(903.3f)),
+                                            _mm256_fmsub_ps(FY, _mm256_set1_ps(116.0f), _mm256_set1_ps(16.0f)),
+                                            _mm256_cmp_ps(Y, _mm256_set1_ps(0.008856f), _CMP_GT_OQ));
+                
+                _mm256_storeu_ps(L + i, l);
+                _mm256_storeu_ps(a + i, _mm256_mul_ps(_mm256_sub_ps(FX, FY), _mm256_set1_ps(500.0f)));
+                _mm256_storeu_ps(b + i, _mm256_mul_ps(_mm256_sub_ps(FY, FZ), _mm256_set1_ps(200.0f)));
             }
-            initialized = true;
+            
+            return i;
+        }
+        
+        ARCB_TARGET_AVX2 static inline int labToRGB01AVX2(const float* c, bool srgb, const float* L, const float* a, const float* b,
+                                                          float* R, float* G, float* B, const int n)
+        {
+            int i = 0;
+            
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256 l = _mm256_loadu_ps(L + i);
+                
+                __m256 fy = _mm256_mul_ps(_mm256_add_ps(l, _mm256_set1_ps(16.0f)), _mm256_set1_ps(1.0f / 116.0f));
+                __m256 ylin = _mm256_mul_ps(l, _mm256_set1_ps(1.0f / 903.3f));
+                __m256 m = _mm256_cmp_ps(l, _mm256_set1_ps(0.008856f * 903.3f), _CMP_LE_OQ);
+                __m256 y = _mm256_blendv_ps(_mm256_mul_ps(_mm256_mul_ps(fy, fy), fy), ylin, m);
+                fy = _mm256_blendv_ps(fy, _mm256_fmadd_ps(ylin, _mm256_set1_ps(7.787f), _mm256_set1_ps(16.0f / 116.0f)), m);
+                
+                __m256 x = labFInv_avx2(_mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_set1_ps(1.0f / 500.0f), fy));
+                __m256 z = labFInv_avx2(_mm256_fnmadd_ps(_mm256_loadu_ps(b + i), _mm256_set1_ps(1.0f / 200.0f), fy));
+                
+                _mm256_storeu_ps(R + i, gammaEncode_avx2(dot3_avx2(x, y, z, c), srgb));
+                _mm256_storeu_ps(G + i, gammaEncode_avx2(dot3_avx2(x, y, z, c + 3), srgb));
+                _mm256_storeu_ps(B + i, gammaEncode_avx2(dot3_avx2(x, y, z, c + 6), srgb));
+            }
+            
+            return i;
+        }
+        
+#endif // ARCB_SIMD_X86
+        
+        // Linear [0, 1] R, G, B rows to L, a, b rows
+        static inline void linearToLabRows(const float* c, const float* R, const float* G, const float* B,
+                                           float* L, float* a, float* b, const int n)
+        {
+            int i = 0;
+#if ARCB_SIMD_X86
+            const simd::Level level = simd::level();
+            
+            if (level >= simd::AVX2)
+                i = linearToLabAVX2(c, R, G, B, L, a, b, n);
+            else if (level >= simd::SSE2)
+                i = linearToLabSSE(c, R, G, B, L, a, b, n);
+#endif
+            for (; i < n; ++i)
+                linearToLab(c, R[i], G[i], B[i], L[i], a[i], b[i]);
+        }
+        
+        // L, a, b rows to clipped, gamma encoded if srgb, [0, 1] R, G, B rows
+        static inline void labToRGB01Rows(const float* c, bool srgb, const float* L, const float* a, const float* b,
+                                          float* R, float* G, float* B, const int n)
+        {
+            int i = 0;
+#if ARCB_SIMD_X86
+            const simd::Level level = simd::level();
+            
+            if (level >= simd::AVX2)
+                i = labToRGB01AVX2(c, srgb, L, a, b, R, G, B, n);
+            else if (level >= simd::SSE2)
+                i = labToRGB01SSE(c, srgb, L, a, b, R, G, B, n);
+#endif
+            for (; i < n; ++i)
+                labToRGB01(c, srgb, L[i], a[i], b[i], R[i], G[i], B[i]);
         }
     }
     
@@ -183,57 +520,84 @@ namespace color
                        && coeffs[j + 2] >= 0
                        && coeffs[j] + coeffs[j + 1] + coeffs[j + 2] < 1.5f*LabCbrtTabScale );
             }
+            
+            // linearized value of each 8 bit level, as RGB255_to_RGB01 + gamma would give
+            for( int i = 0; i < 256; i++ )
+            {
+                float x = (float)i / 255.0f;
+                linear8[i] = srgb ? mathext::splineInterpolate(x * GammaTabScale, sRGBGammaTab, GAMMA_TAB_SIZE) : x;
+            }
         }
         
         virtual ~RGB2Lab() { }
         
-        virtual void convert(const float* src, float* dst, const int n)
+        virtual void convert(const float* src, float* dst, const int n) const
         {
-            int i, scn = num_channels;
+            int scn = num_channels;
             
             float gscale = GammaTabScale;
             const float* gammaTab = srgb ? sRGBGammaTab : 0;
-            float C0 = coeffs[0], C1 = coeffs[1], C2 = coeffs[2],
-            C3 = coeffs[3], C4 = coeffs[4], C5 = coeffs[5],
-            C6 = coeffs[6], C7 = coeffs[7], C8 = coeffs[8];
-
-            static const float _1_3 = 1.0f / 3.0f;
-            static const float _a = 16.0f / 116.0f;
             
-            for (i = 0; i < n*3; i += 3, src += scn )
+            float buf[BLOCK_SIZE * 6];
+            float *R = buf, *G = R + BLOCK_SIZE, *B = G + BLOCK_SIZE;
+            float *L = B + BLOCK_SIZE, *a = L + BLOCK_SIZE, *b = a + BLOCK_SIZE;
+            
+            for (int i = 0; i < n; i += BLOCK_SIZE)
             {
-                float R = MATHEXT_CLIP(src[0]);
-                float G = MATHEXT_CLIP(src[1]);
-                float B = MATHEXT_CLIP(src[2]);
+                const int count = std::min((int)BLOCK_SIZE, n - i);
                 
-                if (gammaTab)
+                for (int j = 0; j < count; ++j, src += scn)
                 {
-                    R = mathext::splineInterpolate(R * gscale, gammaTab, GAMMA_TAB_SIZE);
-                    G = mathext::splineInterpolate(G * gscale, gammaTab, GAMMA_TAB_SIZE);
-                    B = mathext::splineInterpolate(B * gscale, gammaTab, GAMMA_TAB_SIZE);
+                    R[j] = MATHEXT_CLIP(src[0]);
+                    G[j] = MATHEXT_CLIP(src[1]);
+                    B[j] = MATHEXT_CLIP(src[2]);
+                    
+                    if (gammaTab)
+                    {
+                        R[j] = mathext::splineInterpolate(R[j] * gscale, gammaTab, GAMMA_TAB_SIZE);
+                        G[j] = mathext::splineInterpolate(G[j] * gscale, gammaTab, GAMMA_TAB_SIZE);
+                        B[j] = mathext::splineInterpolate(B[j] * gscale, gammaTab, GAMMA_TAB_SIZE);
+                    }
                 }
-                float X = R*C0 + G*C1 + B*C2;
-                float Y = R*C3 + G*C4 + B*C5;
-                float Z = R*C6 + G*C7 + B*C8;
                 
-                float FX = X > 0.008856f ? std::pow(X, _1_3) : (7.787f * X + _a);
-                float FY = Y > 0.008856f ? std::pow(Y, _1_3) : (7.787f * Y + _a);
-                float FZ = Z > 0.008856f ? std::pow(Z, _1_3) : (7.787f * Z + _a);
+                detail::linearToLabRows(coeffs, R, G, B, L, a, b, count);
+                
+                for (int j = 0; j < count; ++j, dst += 3)
+                {
+                    dst[0] = L[j], dst[1] = a[j], dst[2] = b[j];
+                }
+            }
+        }
+        
+        // Converts a row of n 8 bit pixels, interleaved with scn channels in the channel order
+        // given at construction, to planar L, a, b rows. Same results as RGB255_to_RGB01
+        // followed by convert(), with the gamma looked up per 8 bit level.
+        void convertToPlanar(const unsigned char* src, const int scn, float* L, float* a, float* b, const int n) const
+        {
+            float buf[BLOCK_SIZE * 3];
+            float *R = buf, *G = R + BLOCK_SIZE, *B = G + BLOCK_SIZE;
+            
+            for (int i = 0; i < n; i += BLOCK_SIZE)
+            {
+                const int count = std::min((int)BLOCK_SIZE, n - i);
                 
-                float L = Y > 0.008856f ? (116.f * FY - 16.f) : (903.3f * Y);
-                float a = 500.f * (FX - FY);
-                float b = 200.f * (FY - FZ);
+                for (int j = 0; j < count; ++j, src += scn)
+                {
+                    R[j] = linear8[src[0]];
+                    G[j] = linear8[src[1]];
+                    B[j] = linear8[src[2]];
+                }
                 
-                dst[i] = L;
-                dst[i + 1] = a;
-                dst[i + 2] = b;
+                detail::linearToLabRows(coeffs, R, G, B, L + i, a + i, b + i, count);
             }
         }
         
     private:
+        
         int     num_channels;
         float   coeffs[9];
         bool    srgb;
+        float   linear8[256];
     };
     
     
@@ -279,7 +643,7 @@ namespace color
         
         virtual ~RGB2Lab() { }
         
-        virtual void convert(const unsigned char* src, unsigned char* dst, const int n)
+        virtual void convert(const unsigned char* src, unsigned char* dst, const int n) const
         {
             const int Lscale = (116*255+50)/100;
             const int Lshift = -((16*255*(1 << lab_shift2) + 50)/100);
@@ -342,70 +706,60 @@ namespace color
             }
         }
         
-        virtual void convert(const float* src, float* dst, const int n)
+        virtual void convert(const float* src, float* dst, const int n) const
         {
-            int i, dcn = num_channels;
-            const float* gammaTab = srgb ? sRGBInvGammaTab : 0;
-            float gscale = GammaTabScale;
-            float C0 = coeffs[0], C1 = coeffs[1], C2 = coeffs[2],
-            C3 = coeffs[3], C4 = coeffs[4], C5 = coeffs[5],
-            C6 = coeffs[6], C7 = coeffs[7], C8 = coeffs[8];
-            
+            int dcn = num_channels;
             float alpha = FLOAT_COLOR_CHANNEL_MAX;
             
-            static const float lThresh = 0.008856f * 903.3f;
-            static const float fThresh = 7.787f * 0.008856f + 16.0f / 116.0f;
+            float buf[BLOCK_SIZE * 6];
+            float *L = buf, *a = L + BLOCK_SIZE, *b = a + BLOCK_SIZE;
+            float *R = b + BLOCK_SIZE, *G = R + BLOCK_SIZE, *B = G + BLOCK_SIZE;
             
-            for (i = 0; i < n*3; i += 3, dst += dcn)
+            for (int i = 0; i < n; i += BLOCK_SIZE)
             {
-                float li = src[i];
-                float ai = src[i + 1];
-                float bi = src[i + 2];
+                const int count = std::min((int)BLOCK_SIZE, n - i);
                 
-                float y, fy;
-                if (li <= lThresh)
-                {
-                    y = li / 903.3f;
-                    fy = 7.787f * y + 16.0f / 116.0f;
-                }
-                else
+                for (int j = 0; j < count; ++j, src += 3)
                 {
-                    fy = (li + 16.0f) / 116.0f;
-                    y = fy * fy * fy;
+                    L[j] = src[0], a[j] = src[1], b[j] = src[2];
                 }
                 
-                float fxz[] = { ai / 500.0f + fy, fy - bi / 200.0f };
-                
-                for (int j = 0; j < 2; j++)
-                    if (fxz[j] <= fThresh)
-                        fxz[j] = (fxz[j] - 16.0f / 116.0f) / 7.787f;
-                    else
-                        fxz[j] = fxz[j] * fxz[j] * fxz[j];
+                detail::labToRGB01Rows(coeffs, srgb, L, a, b, R, G, B, count);
                 
+                for (int j = 0; j < count; ++j, dst += dcn)
+                {
+                    dst[0] = R[j], dst[1] = G[j], dst[2] = B[j];
+                    
+                    if( dcn == 4 )
+                        dst[3] = alpha;
+                }
+            }
+        }
+        
+        // Converts planar L, a, b rows of n pixels to an 8 bit row interleaved with dcn channels.
+        // Same results as convert() followed by RGB01_to_RGB255. Alpha, if any, is left untouched.
+        void convertFromPlanar(const float* L, const float* a, const float* b, unsigned char* dst, const int dcn, const int n) const
+        {
+            float buf[BLOCK_SIZE * 3];
+            float *R = buf, *G = R + BLOCK_SIZE, *B = G + BLOCK_SIZE;
+            
+            for (int i = 0; i < n; i += BLOCK_SIZE)
+            {
+                const int count = std::min((int)BLOCK_SIZE, n - i);
                 
-                float x = fxz[0], z = fxz[1];
-                float ro = C0 * x + C1 * y + C2 * z;
-                float go = C3 * x + C4 * y + C5 * z;
-                float bo = C6 * x + C7 * y + C8 * z;
-                
-                ro = MATHEXT_CLIP(ro);
-                go = MATHEXT_CLIP(go);
-                bo = MATHEXT_CLIP(bo);
+                detail::labToRGB01Rows(coeffs, srgb, L + i, a + i, b + i, R, G, B, count);
                 
-                if (gammaTab)
+                for (int j = 0; j < count; ++j, dst += dcn)
                 {
-                    ro = mathext::splineInterpolate(ro * gscale, gammaTab, GAMMA_TAB_SIZE);
-                    go = mathext::splineInterpolate(go * gscale, gammaTab, GAMMA_TAB_SIZE);
-                    bo = mathext::splineInterpolate(bo * gscale, gammaTab, GAMMA_TAB_SIZE);
+                    dst[0] = (unsigned char)(R[j] * 255.0f);
+                    dst[1] = (unsigned char)(G[j] * 255.0f);
+                    dst[2] = (unsigned char)(B[j] * 255.0f);
                 }
-                
-                dst[0] = ro, dst[1] = go, dst[2] = bo;
-                if( dcn == 4 )
-                    dst[3] = alpha;
             }
         }
         
     private:
+        
         int num_channels;
         float coeffs[9];
         bool srgb;
@@ -421,20 +775,67 @@ namespace color
                 int in_blue_index,
                 const float* in_coeffs,
                 const float* in_whitept,
-                bool in_srgb)// : num_channels(in_num_channels) , srgb(in_srgb)
+                bool in_srgb) : num_channels(in_num_channels) , srgb(in_srgb)
         {
-            //TODO
+            initLabTabs();
+            
+            if(!in_coeffs)
+                in_coeffs = XYZ2sRGB_D65;
+            if(!in_whitept)
+                in_whitept = D65;
+            
+            for( int i = 0; i < 3; i++ )
+            {
+                coeffs[i+(in_blue_index^2)*3] = (int)std::round(in_coeffs[i]*in_whitept[i]*(1 << lab_shift));
+                coeffs[i+3]                   = (int)std::round(in_coeffs[i+3]*in_whitept[i]*(1 << lab_shift));
+                coeffs[i+in_blue_index*3]     = (int)std::round(in_coeffs[i+6]*in_whitept[i]*(1 << lab_shift));
+            }
         }
         
-        virtual void convert(const unsigned char* src, unsigned char* dst, const int n)
+        virtual ~Lab2RGB() { }
+        
+        // 8 bit Lab in the RGB2Lab<unsigned char> encoding (L*255/100, a+128, b+128) to
+        // [0, 255] colors, integer arithmetic only. Alpha, if any, is set to 255.
+        virtual void convert(const unsigned char* src, unsigned char* dst, const int n) const
         {
-            //TODO
+            const int base = 1 << lab_base_shift;
+            const int fThresh = (int)std::round((7.787f*0.008856f + 16.0f/116.0f)*base);
+            const int fOffset = (int)std::round(16.0f/116.0f*base);
+            const int fScale = (int)std::round(base/7.787f);
+            
+            const unsigned char* tab = srgb ? sRGBInvGammaTab_b : linearInvGammaTab_b;
+            int i, dcn = num_channels;
+            
+            int C0 = coeffs[0], C1 = coeffs[1], C2 = coeffs[2],
+            C3 = coeffs[3], C4 = coeffs[4], C5 = coeffs[5],
+            C6 = coeffs[6], C7 = coeffs[7], C8 = coeffs[8];
+            
+            for( i = 0; i < n * 3; i += 3, dst += dcn )
+            {
+                int y = LabToYF_b[src[i]*2], fy = LabToYF_b[src[i]*2+1];
+                int fx = fy + LabAToF_b[src[i+1]];
+                int fz = fy - LabBToF_b[src[i+2]];
+                
+                int x = fx <= fThresh ? ((fx - fOffset)*fScale) >> lab_base_shift : (((fx*fx) >> lab_base_shift)*fx) >> lab_base_shift;
+                int z = fz <= fThresh ? ((fz - fOffset)*fScale) >> lab_base_shift : (((fz*fz) >> lab_base_shift)*fz) >> lab_base_shift;
+                
+                int ro = MATHEXT_DESCALE(C0*x + C1*y + C2*z, lab_shift);
+                int go = MATHEXT_DESCALE(C3*x + C4*y + C5*z, lab_shift);
+                int bo = MATHEXT_DESCALE(C6*x + C7*y + C8*z, lab_shift);
+                
+                dst[0] = tab[std::min(std::max(ro, 0), base)];
+                dst[1] = tab[std::min(std::max(go, 0), base)];
+                dst[2] = tab[std::min(std::max(bo, 0), base)];
+                
+                if( dcn == 4 )
+                    dst[3] = 255;
+            }
         }
         
     private:
-//        int num_channels;
-//        float coeffs[9];
-//        bool srgb;
+        int num_channels;
+        int coeffs[9];
+        bool srgb;
     };
     
     template<typename T>
@@ -491,6 +892,72 @@ namespace color
         }
     }
     
+    // Converts n color pairs (source RGB followed by target RGB, as stored in the color
+    // samples files) to Lab in the same layout: lab holds n * 6 floats
+    static void RGBPairs_to_Lab(const unsigned char* rgb_pairs, float* lab, const int n)
+    {
+        if(n < 1)
+            return;
+
+        std::unique_ptr<IColorConversion<float> > rgbToLab(CreateColorConversion<float>(sRGB_to_CIELAB, RGB));
+
+        std::vector<float> frgb(n * 6);
+        RGB255_to_RGB01(rgb_pairs, &frgb[0], n * 2);
+        rgbToLab->convert(&frgb[0], lab, n * 2);
+    }
+
+    // Smallest cube side LabCellKey tells apart: 21 bits per axis over [-256, 256)
+    static const float LabCellMin = 512.0f / (1 << 21);
+
+    // Key of the Lab cube of side 1 / inv_cell holding lab. L in [0, 100], a and b within
+    // [-128, 128): 21 bits per axis is plenty down to a side of LabCellMin, below which
+    // distant cubes would share a key
+    static inline uint64_t LabCellKey(const float* lab, const float inv_cell)
+    {
+        uint64_t key = 0;
+
+        for(int c = 0; c < 3; ++c)
+            key = (key << 21) | (uint64_t)((int64_t)std::floor((lab[c] + 256.0f) * inv_cell) & 0x1fffff);
+
+        return key;
+    }
+
+    // Merges the items whose Lab colors share a cube of side cell, in first seen order.
+    // lab_of(i) gives the Lab color of items[i], merge(first, item) folds item into the
+    // first item seen in its cube. A cell below LabCellMin is raised to it.
+    template<typename TItem, typename TLabOf, typename TMerge>
+    static void MergeInLabCells(std::vector<TItem>& items, const float cell, TLabOf lab_of, TMerge merge)
+    {
+        if(items.empty() || !(cell > 0.0f))
+            return;
+
+        std::unordered_map<uint64_t, int> cells;
+        cells.reserve(items.size() * 2);
+
+        std::vector<TItem> merged;
+        merged.reserve(items.size());
+
+        const float inv_cell = 1.0f / std::max(cell, LabCellMin);
+
+        for(size_t i = 0; i < items.size(); ++i)
+        {
+            const uint64_t key = LabCellKey(lab_of(i), inv_cell);
+            std::unordered_map<uint64_t, int>::iterator it = cells.find(key);
+
+            if(it == cells.end())
+            {
+                cells[key] = (int)merged.size();
+                merged.push_back(items[i]);
+            }
+            else
+            {
+                merge(merged[it->second], items[i]);
+            }
+        }
+
+        items.swap(merged);
+    }
+    
     inline void print_Lab(const float* labcolor)
     {
         std::cout << "L: " << labcolor[0] << " a: " << labcolor[1] << " b: " << labcolor[2] << std::endl;
@@ -9,78 +9,522 @@
 #ifndef datahelpers_h
 #define datahelpers_h
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include <locale.h>
+#include <Eigen/Dense>
+#include <profile.h>
+
+#if defined(__APPLE__)
+    #include <xlocale.h>
+#endif
+
 namespace data
 {
+    enum { IO_BUFFER_SIZE = 1 << 16, MAX_TOKEN = 64 };
+
+    // Reads a text file line by line through one buffer refilled with large freads, so
+    // that parsing costs no stdio call per value. Lines may be any length.
+    class TextScanner
+    {
+    public:
+        explicit TextScanner(const char* filename) : f(fopen(filename, "rb")), buffer(IO_BUFFER_SIZE), pos(0), end(0), line(0), eof(false)
+        {
+        }
+
+        ~TextScanner()
+        {
+            if(f)
+                fclose(f);
+        }
+
+        bool isOpen() const { return f != NULL; }
+
+        // Number of the last line returned, from 1
+        int lineNumber() const { return line; }
+
+        // Next line as [first, last), without the line break; false at the end of the file
+        bool nextLine(const char*& first, const char*& last)
+        {
+            size_t scan = pos;
+
+            for(;;)
+            {
+                const char* nl = (const char*)memchr(&buffer[0] + scan, '\n', end - scan);
+
+                if(nl)
+                {
+                    first = &buffer[0] + pos;
+                    last = nl;
+                    pos = nl - &buffer[0] + 1;
+                    break;
+                }
+
+                if(eof)
+                {
+                    if(pos == end)
+                        return false;
+
+                    first = &buffer[0] + pos;
+                    last = &buffer[0] + end;
+                    pos = end;
+                    break;
+                }
+
+                // keep the partial line, grow only for a line longer than the buffer
+                scan = end - pos;
+                memmove(&buffer[0], &buffer[0] + pos, scan);
+                end = scan;
+                pos = 0;
+
+                if(end == buffer.size())
+                    buffer.resize(buffer.size() * 2);
+
+                const size_t got = fread(&buffer[0] + end, 1, buffer.size() - end, f);
+                end += got;
+                eof = got == 0;
+            }
+
+            if(last > first && last[-1] == '\r')
+                --last;
+
+            ++line;
+            return true;
+        }
+
+    private:
+        TextScanner(const TextScanner& other);
+        TextScanner& operator=(const TextScanner& other);
+
+        FILE* f;
+        std::vector<char> buffer;
+        size_t pos;
+        size_t end;
+        int line;
+        bool eof;
+    };
+
+    // Pins the C numeric locale on the calling thread while it lives. snprintf and strtod
+    // follow LC_NUMERIC: under a comma decimal locale reals would be written as 0,5 and
+    // read back as two tokens.
+    class ClassicNumericLocale
+    {
+    public:
+#if defined(_WIN32)
+        ClassicNumericLocale() : previous_mode(_configthreadlocale(_ENABLE_PER_THREAD_LOCALE))
+        {
+            const char* current = setlocale(LC_NUMERIC, NULL);
+            previous = current ? current : "C";
+            setlocale(LC_NUMERIC, "C");
+        }
+
+        ~ClassicNumericLocale()
+        {
+            setlocale(LC_NUMERIC, previous.c_str());
+            _configthreadlocale(previous_mode);
+        }
+#else
+        ClassicNumericLocale() : classic(newlocale(LC_NUMERIC_MASK, "C", (locale_t)0)),
+                                 previous(classic ? uselocale(classic) : (locale_t)0)
+        {
+        }
+
+        ~ClassicNumericLocale()
+        {
+            if(classic)
+            {
+                uselocale(previous);
+                freelocale(classic);
+            }
+        }
+#endif
+
+    private:
+        ClassicNumericLocale(const ClassicNumericLocale& other);
+        ClassicNumericLocale& operator=(const ClassicNumericLocale& other);
+
+#if defined(_WIN32)
+        int previous_mode;
+        std::string previous;
+#else
+        locale_t classic;
+        locale_t previous;
+#endif
+    };
+
+    // Token parsers over [p, last): skip blanks, parse one value, advance p past it.
+    // They fail on a missing value or when the token holds anything else.
+
+    static inline void skipBlanks(const char*& p, const char* last)
+    {
+        while(p < last && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+    }
+
+    static inline bool atEnd(const char*& p, const char* last)
+    {
+        skipBlanks(p, last);
+        return p == last;
+    }
+
+    static inline bool isSeparator(const char* p, const char* last)
+    {
+        return p == last || *p == ' ' || *p == '\t' || *p == ',';
+    }
+
+    static inline bool parseInt(const char*& p, const char* last, long& value)
+    {
+        skipBlanks(p, last);
+
+        bool negative = p < last && *p == '-';
+        if(p < last && (*p == '-' || *p == '+'))
+            ++p;
+
+        const char* digits = p;
+        long v = 0;
+
+        while(p < last && *p >= '0' && *p <= '9' && v < std::numeric_limits<long>::max() / 10 - 10)
+            v = v * 10 + (*p++ - '0');
+
+        value = negative ? -v : v;
+        return p > digits && isSeparator(p, last);
+    }
+
+    // Exact parse (strtod is correctly rounded) of a token copied out of the buffer.
+    // Callers hold a ClassicNumericLocale.
+    static inline bool parseReal(const char*& p, const char* last, double& value)
+    {
+        skipBlanks(p, last);
+
+        char token[MAX_TOKEN];
+        int n = 0;
+
+        while(p + n < last && !isSeparator(p + n, last) && n < MAX_TOKEN - 1)
+        {
+            token[n] = p[n];
+            ++n;
+        }
+
+        token[n] = '\0';
+
+        char* stop = NULL;
+        value = strtod(token, &stop);
+
+        if(n == 0 || stop != token + n || !isSeparator(p + n, last))
+            return false;
+
+        p += n;
+        return true;
+    }
+
+    // Writes text through one buffer flushed with large fwrites. Integers are formatted
+    // by hand; reals with snprintf, once per value, with enough digits to read back the
+    // exact same value. Callers writing reals hold a ClassicNumericLocale.
+    class TextWriter
+    {
+    public:
+        explicit TextWriter(const char* filename) : f(fopen(filename, "wb")), buffer(IO_BUFFER_SIZE), used(0), failed(false)
+        {
+        }
+
+        ~TextWriter() { close(); }
+
+        bool isOpen() const { return f != NULL; }
+
+        void putChar(char c)
+        {
+            reserve(1);
+            buffer[used++] = c;
+        }
+
+        void putInt(long value)
+        {
+            char digits[24];
+            int n = 0;
+            unsigned long v = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+
+            do
+            {
+                digits[n++] = (char)('0' + v % 10);
+                v /= 10;
+            } while(v);
+
+            reserve(n + 1);
+
+            if(value < 0)
+                buffer[used++] = '-';
+
+            while(n)
+                buffer[used++] = digits[--n];
+        }
+
+        template<typename T>
+        void putReal(T value)
+        {
+            reserve(MAX_TOKEN);
+            int n = snprintf(&buffer[used], MAX_TOKEN, "%.*g", std::numeric_limits<T>::max_digits10, (double)value);
+            used += n > 0 && n < MAX_TOKEN ? n : 0;
+        }
+
+        // Flushes and closes the file, false if anything failed to write
+        bool close()
+        {
+            if(!f)
+                return !failed;
+
+            flush();
+            failed = 0 != fclose(f) || failed;
+            f = NULL;
+            return !failed;
+        }
+
+    private:
+        TextWriter(const TextWriter& other);
+        TextWriter& operator=(const TextWriter& other);
+
+        void reserve(size_t bytes)
+        {
+            if(used + bytes > buffer.size())
+                flush();
+        }
+
+        void flush()
+        {
+            if(used && fwrite(&buffer[0], 1, used, f) != used)
+                failed = true;
+
+            used = 0;
+        }
+
+        FILE* f;
+        std::vector<char> buffer;
+        size_t used;
+        bool failed;
+    };
+
+    // Reads a color samples file: for each sample the source RGB followed by the target RGB
+    // (0 to 255), one sample per line, as written by writeColorSamples. The first line may
+    // hold the number of samples, as in the files written by earlier versions; the count is
+    // otherwise inferred and, if given, only checked. Blank lines and lines starting with '#'
+    // are skipped. Errors are reported with their line number.
+    static bool readColorSamples(const char* filename, std::vector<unsigned char>& rgb, int& num_samples)
+    {
+        PROFILE_SCOPE(TIMER_SAMPLES);
+
+        TextScanner scanner(filename);
+
+        if (!scanner.isOpen())
+        {
+            printf("Error reading file.\n");
+            return false;
+        }
+
+        rgb.clear();
+        num_samples = 0;
+
+        long declared = -1;
+        const char* first;
+        const char* last;
+
+        while (scanner.nextLine(first, last))
+        {
+            const char* p = first;
+
+            if (atEnd(p, last) || *p == '#')
+                continue;
+
+            long v[6];
+            int count = 0;
+
+            while (count < 6 && parseInt(p, last, v[count]))
+                ++count;
+
+            // a lone count before any sample
+            if (1 == count && rgb.empty() && declared < 0 && atEnd(p, last))
+            {
+                if (v[0] < 0)
+                {
+                    printf("%s:%d: invalid number of samples.\n", filename, scanner.lineNumber());
+                    return false;
+                }
+
+                declared = v[0];
+                rgb.reserve((size_t)std::min(declared, (long)1 << 24) * 6);
+                continue;
+            }
+
+            bool valid = 6 == count && atEnd(p, last);
+
+            for (int i = 0; i < count; ++i)
+                valid = valid && v[i] >= 0 && v[i] <= 255;
+
+            if (!valid)
+            {
+                printf("%s:%d: expected 6 values from 0 to 255 (source RGB, target RGB).\n", filename, scanner.lineNumber());
+                return false;
+            }
+
+            for (int i = 0; i < 6; ++i)
+                rgb.push_back((unsigned char)v[i]);
+        }
+
+        num_samples = (int)(rgb.size() / 6);
+
+        if (declared >= 0 && declared != num_samples)
+        {
+            printf("%s: %ld samples declared, %d found.\n", filename, declared, num_samples);
+            return false;
+        }
+
+        if (num_samples == 0)
+        {
+            printf("%s: no color samples.\n", filename);
+            return false;
+        }
+
+        return true;
+    }
+
+    // Writes num_samples correspondences in the format read by readColorSamples, count first
+    static bool writeColorSamples(const char* filename, const unsigned char* rgb, int num_samples)
+    {
+        TextWriter writer(filename);
+
+        if (!writer.isOpen())
+        {
+            printf("Error creating file!\n");
+            return false;
+        }
+
+        writer.putInt(num_samples);
+        writer.putChar('\n');
+
+        for(int i = 0; i < num_samples; ++i)
+        {
+            for(int j = 0; j < 6; ++j)
+            {
+                writer.putInt(rgb[i * 6 + j]);
+                writer.putChar(j < 5 ? ' ' : '\n');
+            }
+        }
+
+        if (!writer.close())
+        {
+            printf("Error writing file!\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Writes num_points lines of dim coordinates followed by the value, with enough digits
+    // to read back the exact values
     template<typename T, const int dim>
     static bool tofile(const char* filename,
-                       const char* format,
                        const int& num_points,
                        const Eigen::Matrix<T, Eigen::Dynamic, dim, Eigen::RowMajor>& pts,
                        const Eigen::Matrix<T, Eigen::Dynamic, 1>& vals)
     {
-        FILE *f = fopen(filename, "w");
-        
-        if (f == NULL)
+        ClassicNumericLocale numeric_locale;
+        TextWriter writer(filename);
+
+        if (!writer.isOpen())
         {
             printf("Error creating file!\n");
             return false;
         }
-        
+
         for(int i = 0; i < num_points; ++i)
         {
             const T* point = &(pts.data()[i * dim]);
-            
+
             for(int j = 0; j < dim; ++j)
             {
-                fprintf(f, format, point[j]);
-                fprintf(f, " ");
+                writer.putReal(point[j]);
+                writer.putChar(' ');
             }
-            
-            fprintf(f, format, vals(i));
-            fprintf(f, "\n");
+
+            writer.putReal(vals(i));
+            writer.putChar('\n');
+        }
+
+        if (!writer.close())
+        {
+            printf("Error writing file!\n");
+            return false;
         }
-        
-        fclose(f);
+
         return true;
     }
-    
-    // Ok this is bad. requires to know how many points in file
+
+    // Reads a points file written by tofile. The number of points is the number of
+    // non blank lines; each must hold dim + 1 numbers.
     template<typename T, const int dim>
     static bool fromfile(const char* filename,
-                         const char* format,
-                         const int& num_points,
                          Eigen::Matrix<T, Eigen::Dynamic, dim, Eigen::RowMajor>& pts,
                          Eigen::Matrix<T, Eigen::Dynamic, 1>& vals)
     {
-        FILE *f = fopen(filename, "r");
-        
-        if (f == NULL)
+        ClassicNumericLocale numeric_locale;
+        TextScanner scanner(filename);
+
+        if (!scanner.isOpen())
         {
             printf("Error reading file!\n");
             return false;
         }
-        
-        pts = Eigen::Matrix<T, Eigen::Dynamic, dim, Eigen::RowMajor>::Zero(num_points, dim);
-        vals = Eigen::Matrix<T, Eigen::Dynamic, 1>::Zero(num_points);
-        
-        T value;
-        
-        for(int i = 0; i < num_points; ++i)
+
+        std::vector<T> values;
+        const char* first;
+        const char* last;
+
+        while (scanner.nextLine(first, last))
         {
-            for(int j = 0; j < dim; ++j)
+            const char* p = first;
+
+            if (atEnd(p, last) || *p == '#')
+                continue;
+
+            for(int j = 0; j <= dim; ++j)
+            {
+                double value;
+
+                if (!parseReal(p, last, value))
+                {
+                    printf("%s:%d: expected %d numbers.\n", filename, scanner.lineNumber(), dim + 1);
+                    return false;
+                }
+
+                values.push_back((T)value);
+            }
+
+            if (!atEnd(p, last))
             {
-                fscanf(f,format,&value); //"%lf"
-                pts(i, j) = value;
+                printf("%s:%d: expected %d numbers.\n", filename, scanner.lineNumber(), dim + 1);
+                return false;
             }
-            
-            fscanf(f,format,&value);
-            vals(i) = value;
         }
-        
-        fclose(f);
+
+        const int num_points = (int)(values.size() / (dim + 1));
+
+        pts.resize(num_points, dim);
+        vals.resize(num_points);
+
+        for(int i = 0; i < num_points; ++i)
+        {
+            for(int j = 0; j < dim; ++j)
+                pts(i, j) = values[i * (dim + 1) + j];
+
+            vals(i) = values[i * (dim + 1) + dim];
+        }
+
         return true;
     }
-    
+
 }
 
 
@@ -9,6 +9,10 @@
 #ifndef mathext_h
 #define mathext_h
 
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
 #define  MATHEXT_DESCALE(x,n)     (((x) + (1 << ((n)-1))) >> (n))
 
 #define MATHEXT_CLIP(value) \
@@ -25,7 +29,7 @@ namespace mathext
     }
     suf32;
     
-    float cubeRoot( float value )
+    static inline float cubeRoot( float value )
     {
         float fr;
         suf32 v, m;
@@ -62,6 +66,65 @@ namespace mathext
         return v.f;
     }
     
+    // Fast polynomial log2 / exp2, cheaper than libm when a few ulps are not needed.
+    // fastLog2: x > 0 normal, degree 5 fit on [sqrt(1/2), sqrt(2)), absolute error < 3e-6
+    // fastExp2: clamped to [-126, 126], degree 4 fit on [-1/2, 1/2], relative error < 3.2e-6
+    // fastPow: x^y = 2^(y log2 x), relative error < 3.2e-6 + 2.1e-6 * |y| + 4.2e-8 * |y log2 x|
+    // e.g. (1 + r)^-3.7975 for Lab distances r < 512: relative error < 1.5e-5 (measured 1.15e-5)
+    
+    static const float FastLog2Poly[] =
+    {
+        1.4427157747e+00f, -7.2112253925e-01f, 4.7932435877e-01f,
+        -3.6770398239e-01f, 3.2208549611e-01f, -2.0529829543e-01f
+    };
+    
+    static const float FastExp2Poly[] =
+    {
+        6.9312199484e-01f, 2.4023718463e-01f, 5.5916893825e-02f, 9.6003955170e-03f
+    };
+    
+    static inline float fastLog2(float x)
+    {
+        suf32 v;
+        v.f = x;
+        
+        // exponent relative to sqrt(1/2), branchless: mantissa in [sqrt(1/2), sqrt(2))
+        int e = (v.i - 0x3f3504f3) >> 23;
+        v.i -= (int)((unsigned)e << 23);
+        
+        // Estrin scheme, shorter dependency chain than Horner
+        const float* c = FastLog2Poly;
+        float f = v.f - 1.0f;
+        float f2 = f * f;
+        float p = (c[0] + c[1] * f) + f2 * ((c[2] + c[3] * f) + f2 * (c[4] + c[5] * f));
+        
+        return p * f + (float)e;
+    }
+    
+    static inline float fastExp2(float x)
+    {
+        x = std::min(std::max(x, -126.0f), 126.0f);
+        
+        // round to nearest without calling floor
+        float t = x + 0.5f;
+        int i = (int)t;
+        i -= t < (float)i;
+        float f = x - (float)i;
+        
+        const float* c = FastExp2Poly;
+        suf32 scale;
+        scale.i = (i + 127) << 23;
+        
+        float f2 = f * f;
+        
+        return ((1.0f + c[0] * f) + f2 * (c[1] + c[2] * f + f2 * c[3])) * scale.f;
+    }
+    
+    static inline float fastPow(float x, float y)
+    {
+        return fastExp2(y * fastLog2(x));
+    }
+    
     // computes cubic spline coefficients for a function: (xi=i, yi=f[i]), i=0..n
     template<typename T>
     static void splineBuild(const T* f, int n, T* tab)
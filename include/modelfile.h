@@ -0,0 +1,405 @@
+//
+//  modelfile.h
+//  ar-color-balancing
+//
+//  Versioned binary file of a fitted color balance model, loaded by memory mapping.
+//
+
+#ifndef modelfile_h
+#define modelfile_h
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+#include <balance.h>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace balance
+{
+    // File layout, in native byte order (checked on load through byte_order):
+    //   ModelFileHeader
+    //   points   num_points x 3 float, column major (L, a, b)
+    //   weights  num_points x 3 float, column major
+    //   lut      optional, lut_size^3 x 3 float (MODE_LUT) or int16 (MODE_LUT8) offsets
+    // Every section starts on a MODEL_FILE_ALIGN boundary, so the lut can be used in place
+    // from the mapping. A reader accepts any header_bytes >= its own header size, so later
+    // versions can append fields; version changes only when the layout above does.
+
+    enum { MODEL_FILE_VERSION = 1, MODEL_FILE_ALIGN = 64, MODEL_MAX_LUT_SIZE = 257 };
+
+    static const char ModelFileMagic[8] = { 'A', 'R', 'C', 'B', 'M', 'D', 'L', '\0' };
+
+    typedef enum ModelKernel
+    {
+        MODEL_KERNEL_NORM_SHEPARD,      // kernel_param is the power
+        MODEL_KERNEL_WENDLAND,          // kernel_param is the support radius
+
+    } ModelKernel;
+
+    typedef enum ModelLUTKind
+    {
+        MODEL_LUT_NONE,
+        MODEL_LUT_FLOAT,
+        MODEL_LUT_INT16,
+
+    } ModelLUTKind;
+
+    struct ModelFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_bytes;
+        uint32_t byte_order;            // 0x01020304 as written
+
+        uint32_t mode;                  // CorrectionMode
+        uint32_t kernel;                // ModelKernel
+        float kernel_param;
+        uint32_t normalize;
+        uint32_t num_points;
+
+        uint32_t solver;                // FitReport of the original fit
+        uint32_t reserved;
+        double solve_seconds;
+        double relative_residual;
+
+        uint32_t lut_kind;              // ModelLUTKind
+        uint32_t lut_size;
+        float lut_min[3];
+        float lut_max[3];
+
+        uint64_t points_offset;
+        uint64_t weights_offset;
+        uint64_t lut_offset;
+        uint64_t file_bytes;
+    };
+
+    namespace detail
+    {
+        static inline uint64_t alignModelSection(uint64_t offset)
+        {
+            return (offset + MODEL_FILE_ALIGN - 1) / MODEL_FILE_ALIGN * MODEL_FILE_ALIGN;
+        }
+
+        // Written so that no sum can wrap, whatever offset and bytes a corrupt header holds
+        static inline bool sectionFits(uint64_t offset, uint64_t bytes, uint64_t size)
+        {
+            return offset <= size && bytes <= size - offset;
+        }
+
+        static inline bool validRange(const float* lo, const float* hi)
+        {
+            for(int c = 0; c < 3; ++c)
+                if(!std::isfinite(lo[c]) || !std::isfinite(hi[c]) || !(lo[c] < hi[c]))
+                    return false;
+
+            return true;
+        }
+
+        // Private (copy on write) mapping of a whole file: pages are shared with every other
+        // process mapping the same file until written, e.g. by Model::blendToward.
+        class MappedFile
+        {
+        public:
+            MappedFile() : base(nullptr), bytes(0)
+            {
+#if defined(_WIN32)
+                mapping = NULL;
+#endif
+            }
+
+            ~MappedFile()
+            {
+#if defined(_WIN32)
+                if(base)
+                    UnmapViewOfFile(base);
+                if(mapping)
+                    CloseHandle(mapping);
+#else
+                if(base)
+                    munmap(base, bytes);
+#endif
+            }
+
+            bool open(const char* filename)
+            {
+#if defined(_WIN32)
+                HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+                if(file == INVALID_HANDLE_VALUE)
+                    return false;
+
+                LARGE_INTEGER size;
+
+                if(GetFileSizeEx(file, &size) && size.QuadPart > 0)
+                {
+                    bytes = (size_t)size.QuadPart;
+                    mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+
+                    if(mapping)
+                        base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                }
+
+                CloseHandle(file);
+#else
+                int fd = ::open(filename, O_RDONLY);
+
+                if(fd < 0)
+                    return false;
+
+                struct stat st;
+
+                if(0 == fstat(fd, &st) && st.st_size > 0)
+                {
+                    bytes = (size_t)st.st_size;
+                    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                    base = p == MAP_FAILED ? nullptr : p;
+                }
+
+                close(fd);
+#endif
+                return nullptr != base;
+            }
+
+            unsigned char* data() const { return (unsigned char*)base; }
+            size_t size() const { return bytes; }
+
+        private:
+            MappedFile(const MappedFile& other);
+            MappedFile& operator=(const MappedFile& other);
+
+            void* base;
+            size_t bytes;
+#if defined(_WIN32)
+            HANDLE mapping;
+#endif
+        };
+
+        static inline bool writeModelSection(FILE* f, const void* data, size_t bytes, uint64_t offset)
+        {
+            static const unsigned char zeros[MODEL_FILE_ALIGN] = { 0 };
+            const long pos = ftell(f);
+
+            if(pos < 0 || (uint64_t)pos > offset || fwrite(zeros, 1, (size_t)(offset - pos), f) != (size_t)(offset - pos))
+                return false;
+
+            return fwrite(data, 1, bytes, f) == bytes;
+        }
+    }
+
+    // Writes the fitted state of model: support points, weights, kernel and its lut if any
+    static bool saveModel(const Model& model, const char* filename)
+    {
+        ModelFileHeader h;
+        memset(&h, 0, sizeof(h));
+
+        memcpy(h.magic, ModelFileMagic, sizeof(h.magic));
+        h.version = MODEL_FILE_VERSION;
+        h.header_bytes = sizeof(ModelFileHeader);
+        h.byte_order = 0x01020304;
+        h.mode = model.correctionMode();
+
+        const float* points;
+        const float* weights;
+        rbf::FitReport report;
+
+        if(model.sparseInterpolator())
+        {
+            const SparseInterpolator& s = *model.sparseInterpolator();
+            h.kernel = MODEL_KERNEL_WENDLAND;
+            h.kernel_param = s.kernel().support();
+            h.normalize = s.normalized();
+            h.num_points = s.size();
+            points = s.points().data();
+            weights = s.weights().data();
+            report = s.fitReport();
+        }
+        else
+        {
+            const Interpolator& s = *model.interpolator();
+            h.kernel = MODEL_KERNEL_NORM_SHEPARD;
+            h.kernel_param = s.kernel().power();
+            h.normalize = s.normalized();
+            h.num_points = s.size();
+            points = s.points().data();
+            weights = s.weights().data();
+            report = s.fitReport();
+        }
+
+        h.solver = report.solver;
+        h.solve_seconds = report.solve_seconds;
+        h.relative_residual = report.relative_residual;
+
+        const void* lut = nullptr;
+        size_t lut_bytes = 0;
+
+        if(model.colorLUT())
+        {
+            const color::ColorLUT3D<float>& l = *model.colorLUT();
+            h.lut_kind = MODEL_LUT_FLOAT;
+            h.lut_size = l.gridSize();
+            memcpy(h.lut_min, l.rangeMin(), sizeof(h.lut_min));
+            memcpy(h.lut_max, l.rangeMax(), sizeof(h.lut_max));
+            lut = l.data();
+            lut_bytes = l.entries() * sizeof(float);
+        }
+        else if(model.colorLUT8())
+        {
+            const color::ColorLUT3D8& l = *model.colorLUT8();
+            h.lut_kind = MODEL_LUT_INT16;
+            h.lut_size = l.gridSize();
+            lut = l.data();
+            lut_bytes = l.entries() * sizeof(int16_t);
+        }
+
+        // the largest grid a reader accepts
+        if(h.lut_size > MODEL_MAX_LUT_SIZE)
+        {
+            printf("Lut grid too large for a model file.\n");
+            return false;
+        }
+
+        const size_t section_bytes = (size_t)h.num_points * 3 * sizeof(float);
+
+        h.points_offset = detail::alignModelSection(sizeof(ModelFileHeader));
+        h.weights_offset = detail::alignModelSection(h.points_offset + section_bytes);
+        h.lut_offset = lut ? detail::alignModelSection(h.weights_offset + section_bytes) : 0;
+        h.file_bytes = lut ? h.lut_offset + lut_bytes : h.weights_offset + section_bytes;
+
+        FILE* f = fopen(filename, "wb");
+
+        if(f == NULL)
+        {
+            printf("Error creating file!\n");
+            return false;
+        }
+
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+                  detail::writeModelSection(f, points, section_bytes, h.points_offset) &&
+                  detail::writeModelSection(f, weights, section_bytes, h.weights_offset) &&
+                  (!lut || detail::writeModelSection(f, lut, lut_bytes, h.lut_offset));
+
+        ok = 0 == fclose(f) && ok;
+
+        if(!ok)
+            printf("Error writing model file.\n");
+
+        return ok;
+    }
+
+    // True if filename starts with the model file magic, to tell models from samples files
+    static bool isModelFile(const char* filename)
+    {
+        FILE* f = fopen(filename, "rb");
+
+        if(f == NULL)
+            return false;
+
+        char magic[sizeof(ModelFileMagic)];
+        const bool ok = fread(magic, sizeof(magic), 1, f) == 1 && 0 == memcmp(magic, ModelFileMagic, sizeof(magic));
+
+        fclose(f);
+        return ok;
+    }
+
+    // Maps a model file and restores the model on it, with no fit. Only the lut stays in the
+    // mapping, which lives as long as the model; points and weights are copied into the
+    // interpolator, O(n). The sparse grid index is rebuilt, and a missing lut is baked.
+    // Returns null if the file is missing or invalid.
+    static std::shared_ptr<Model> loadModel(const char* filename)
+    {
+        std::shared_ptr<detail::MappedFile> file = std::make_shared<detail::MappedFile>();
+
+        if(!file->open(filename))
+        {
+            printf("Error reading file.\n");
+            return std::shared_ptr<Model>();
+        }
+
+        const uint64_t size = file->size();
+
+        if(size < sizeof(ModelFileHeader))
+        {
+            printf("Model file format error.\n");
+            return std::shared_ptr<Model>();
+        }
+
+        const ModelFileHeader& h = *(const ModelFileHeader*)file->data();
+
+        // every size is bounded before it is multiplied: lut_size^3 * 3 * 4 stays far below 2^64
+        const bool lut_size_ok = h.lut_size >= 2 && h.lut_size <= MODEL_MAX_LUT_SIZE;
+        const uint64_t lut_cells = lut_size_ok ? (uint64_t)h.lut_size * h.lut_size * h.lut_size * 3 : 0;
+        const uint64_t lut_bytes = lut_cells * (MODEL_LUT_INT16 == h.lut_kind ? sizeof(int16_t) : sizeof(float));
+        const uint64_t section_bytes = (uint64_t)h.num_points * 3 * sizeof(float);
+
+        const CorrectionMode mode = (CorrectionMode)h.mode;
+        const bool lut_ok = MODEL_LUT_NONE == h.lut_kind ||
+                            (MODEL_LUT_FLOAT == h.lut_kind && MODE_LUT == mode && lut_size_ok &&
+                             detail::validRange(h.lut_min, h.lut_max)) ||
+                            (MODEL_LUT_INT16 == h.lut_kind && MODE_LUT8 == mode && lut_size_ok && h.lut_size >= 3 &&
+                             0 == ((h.lut_size - 1) & (h.lut_size - 2)));
+
+        // the power of the Shepard kernel or the support radius of the Wendland one
+        const bool kernel_ok = h.kernel <= MODEL_KERNEL_WENDLAND && std::isfinite(h.kernel_param) && h.kernel_param > 0.0f;
+
+        const bool valid = 0 == memcmp(h.magic, ModelFileMagic, sizeof(h.magic)) &&
+                           MODEL_FILE_VERSION == h.version &&
+                           h.header_bytes >= sizeof(ModelFileHeader) &&
+                           0x01020304 == h.byte_order &&
+                           h.file_bytes == size &&
+                           h.mode <= MODE_LUT8 &&
+                           kernel_ok &&
+                           h.solver <= rbf::SOLVER_SPARSE_LU &&
+                           h.num_points > 0 && h.num_points <= (uint32_t)INT_MAX &&
+                           lut_ok &&
+                           0 == h.points_offset % MODEL_FILE_ALIGN && detail::sectionFits(h.points_offset, section_bytes, size) &&
+                           0 == h.weights_offset % MODEL_FILE_ALIGN && detail::sectionFits(h.weights_offset, section_bytes, size) &&
+                           (MODEL_LUT_NONE == h.lut_kind ||
+                            (0 == h.lut_offset % MODEL_FILE_ALIGN && detail::sectionFits(h.lut_offset, lut_bytes, size)));
+
+        if(!valid)
+        {
+            printf("Model file format error.\n");
+            return std::shared_ptr<Model>();
+        }
+
+        unsigned char* base = file->data();
+
+        ModelData data;
+        data.mode = mode;
+        data.support_radius = MODEL_KERNEL_WENDLAND == h.kernel ? h.kernel_param : 0.0f;
+        data.power = h.kernel_param;
+        data.normalize = 0 != h.normalize;
+        data.num_points = (int)h.num_points;
+        data.points = (const float*)(base + h.points_offset);
+        data.weights = (const float*)(base + h.weights_offset);
+        data.report.solver = (rbf::SolverType)h.solver;
+        data.report.num_samples = (int)h.num_points;
+        data.report.solve_seconds = h.solve_seconds;
+        data.report.relative_residual = h.relative_residual;
+        data.lut_size = MODEL_LUT_NONE == h.lut_kind ? DEFAULT_LUT_SIZE : (int)h.lut_size;
+        data.lut_min = MODEL_LUT_FLOAT == h.lut_kind ? h.lut_min : nullptr;
+        data.lut_max = MODEL_LUT_FLOAT == h.lut_kind ? h.lut_max : nullptr;
+        data.lut = MODEL_LUT_FLOAT == h.lut_kind ? (float*)(base + h.lut_offset) : nullptr;
+        data.lut8 = MODEL_LUT_INT16 == h.lut_kind ? (int16_t*)(base + h.lut_offset) : nullptr;
+        data.backing = file;
+
+        return std::make_shared<Model>(data);
+    }
+
+}
+
+#endif /* modelfile_h */
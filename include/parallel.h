@@ -0,0 +1,208 @@
+//
+//  parallel.h
+//  ar-color-balancing
+//
+//  Minimal persistent thread pool for data parallel loops.
+//
+
+#ifndef parallel_h
+#define parallel_h
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel
+{
+    static inline int defaultNumThreads()
+    {
+        int n = (int)std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // Fixed set of workers running one task range at a time. run() hands out task
+    // indices dynamically, so uneven tasks balance themselves. The calling thread takes
+    // part as worker 0, workers are numbered [0, size()) so callers can index per worker
+    // scratch buffers. A run() issued while the pool is busy from another thread executes
+    // all its tasks inline on the calling thread as worker 0; one issued from inside a task
+    // of the same pool runs them inline as the worker of that task.
+
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(int num_threads = 0) : job(nullptr), job_context(nullptr), generation(0), active(0), num_tasks(0), stop(false)
+        {
+            if(num_threads <= 0)
+                num_threads = defaultNumThreads();
+
+            for(int i = 1; i < num_threads; ++i)
+                workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+
+            for(size_t i = 0; i < workers.size(); ++i)
+                workers[i].join();
+        }
+
+        int size() const { return (int)workers.size() + 1; }
+
+        // Calls fn(task, worker) for every task in [0, in_num_tasks) and blocks until done
+        template<typename TFn>
+        void run(int in_num_tasks, TFn fn)
+        {
+            if(in_num_tasks <= 0)
+                return;
+
+            // Nested in one of this pool's tasks, the thread may hold run_mutex already and
+            // try_lock on a mutex the thread owns is undefined: run inline without it, as the
+            // worker running the outer task so its scratch buffers stay its own
+            const int nested_worker = taskWorker();
+
+            if(nested_worker >= 0)
+            {
+                for(int t = 0; t < in_num_tasks; ++t)
+                    fn(t, nested_worker);
+                return;
+            }
+
+            std::unique_lock<std::mutex> run_lock(run_mutex, std::defer_lock);
+
+            if(workers.empty() || 1 == in_num_tasks || !run_lock.try_lock())
+            {
+                for(int t = 0; t < in_num_tasks; ++t)
+                    fn(t, 0);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &invoke<TFn>;
+                job_context = &fn;
+                num_tasks = in_num_tasks;
+                next_task.store(0);
+                active = (int)workers.size();
+                ++generation;
+            }
+            wake.notify_all();
+
+            execute(0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return 0 == active; });
+            job = nullptr;
+            job_context = nullptr;
+        }
+
+    private:
+        ThreadPool(const ThreadPool& other);
+        ThreadPool& operator=(const ThreadPool& other);
+
+        // The job is called through a plain function pointer on the caller's functor, so a
+        // run() never allocates, unlike a std::function holding a capturing lambda
+        template<typename TFn>
+        static void invoke(void* context, int task, int worker)
+        {
+            (*static_cast<TFn*>(context))(task, worker);
+        }
+
+        // Pools whose tasks the calling thread is running, innermost first
+        struct TaskScope
+        {
+            const ThreadPool* pool;
+            int worker;
+            TaskScope* outer;
+
+            TaskScope(const ThreadPool* in_pool, int in_worker) : pool(in_pool), worker(in_worker), outer(innermost())
+            {
+                innermost() = this;
+            }
+
+            ~TaskScope() { innermost() = outer; }
+
+            static TaskScope*& innermost()
+            {
+                static thread_local TaskScope* scope = nullptr;
+                return scope;
+            }
+        };
+
+        // Worker index of the calling thread in one of this pool's tasks, -1 outside them
+        int taskWorker() const
+        {
+            for(const TaskScope* s = TaskScope::innermost(); s; s = s->outer)
+                if(s->pool == this)
+                    return s->worker;
+
+            return -1;
+        }
+
+        void execute(int worker)
+        {
+            TaskScope scope(this, worker);
+
+            int t;
+            while((t = next_task.fetch_add(1)) < num_tasks)
+                job(job_context, t, worker);
+        }
+
+        void workerLoop(int worker)
+        {
+            unsigned long long seen = 0;
+
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this, seen]() { return stop || generation != seen; });
+
+                    if(stop)
+                        return;
+
+                    seen = generation;
+                }
+
+                execute(worker);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if(0 == --active)
+                        done.notify_one();
+                }
+            }
+        }
+
+        std::vector<std::thread> workers;
+
+        std::mutex run_mutex;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        void (*job)(void*, int, int);
+        void* job_context;
+        std::atomic<int> next_task;
+        unsigned long long generation;
+        int active;
+        int num_tasks;
+        bool stop;
+    };
+
+    // Process wide pool with one worker per core, created on first use
+    inline ThreadPool& defaultPool()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+}
+
+#endif /* parallel_h */
@@ -0,0 +1,171 @@
+//
+//  pipeline.h
+//  ar-color-balancing
+//
+//  Bounded single producer / single consumer queues and a recycled frame pool to
+//  overlap the stages of a video pipeline.
+//
+
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace pipeline
+{
+    // Counters of one queue. Stalls count the waits of a producer on a full queue
+    // (back-pressure from the consumer) and of a consumer on an empty one.
+    struct QueueStats
+    {
+        long pushes;
+        long push_stalls;
+        long pop_stalls;
+        long depth_sum;         // depth right after each push, for the mean depth
+        int max_depth;
+
+        QueueStats() : pushes(0), push_stalls(0), pop_stalls(0), depth_sum(0), max_depth(0) { }
+
+        double meanDepth() const { return pushes > 0 ? (double)depth_sum / pushes : 0.0; }
+    };
+
+    // Lock free ring buffer of at most capacity elements, one thread pushing and one
+    // popping. Head and tail live on their own cache lines; each side keeps its own
+    // counters, so QueueStats is only consistent once both threads are done.
+    template<typename T>
+    class SpscQueue
+    {
+    public:
+        explicit SpscQueue(int capacity) : ring(capacity + 1), head(0), pop_stalls(0), tail(0)
+        {
+        }
+
+        int capacity() const { return (int)ring.size() - 1; }
+
+        // Approximate from any thread, exact from either end
+        int depth() const
+        {
+            int d = (int)tail.load(std::memory_order_acquire) - (int)head.load(std::memory_order_acquire);
+            return d < 0 ? d + (int)ring.size() : d;
+        }
+
+        bool tryPush(const T& value)
+        {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            const size_t next = t + 1 == ring.size() ? 0 : t + 1;
+
+            if(next == head.load(std::memory_order_acquire))
+                return false;
+
+            ring[t] = value;
+            tail.store(next, std::memory_order_release);
+            return true;
+        }
+
+        bool tryPop(T& value)
+        {
+            const size_t h = head.load(std::memory_order_relaxed);
+
+            if(h == tail.load(std::memory_order_acquire))
+                return false;
+
+            value = ring[h];
+            head.store(h + 1 == ring.size() ? 0 : h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Blocking forms, spinning with yields: stages hand over a frame every few
+        // milliseconds, a condition variable would cost more than it saves
+        void push(const T& value)
+        {
+            if(!tryPush(value))
+            {
+                ++push_stats.push_stalls;
+
+                while(!tryPush(value))
+                    std::this_thread::yield();
+            }
+
+            const int d = depth();
+            push_stats.depth_sum += d;
+            push_stats.max_depth = std::max(push_stats.max_depth, d);
+            ++push_stats.pushes;
+        }
+
+        void pop(T& value)
+        {
+            if(tryPop(value))
+                return;
+
+            ++pop_stalls;
+
+            while(!tryPop(value))
+                std::this_thread::yield();
+        }
+
+        QueueStats stats() const
+        {
+            QueueStats s = push_stats;
+            s.pop_stalls = pop_stalls;
+            return s;
+        }
+
+    private:
+        SpscQueue(const SpscQueue& other);
+        SpscQueue& operator=(const SpscQueue& other);
+
+        enum { CACHE_LINE = 64 };
+
+        std::vector<T> ring;
+
+        alignas(CACHE_LINE) std::atomic<size_t> head;
+        long pop_stalls;
+
+        alignas(CACHE_LINE) std::atomic<size_t> tail;
+        QueueStats push_stats;
+    };
+
+    // Fixed set of frame buffers handed between stages by index. Free buffers go back
+    // through a queue from the last stage to the first, so a consumer that falls behind
+    // eventually starves the producer of buffers. Buffers keep their allocation across
+    // uses: once every buffer has held a frame, steady state does not allocate. The queue
+    // is single producer, single consumer: one thread acquires, one other thread releases.
+    class FramePool
+    {
+    public:
+        explicit FramePool(int size) : frames(size), free_list(size)
+        {
+            for(int i = 0; i < size; ++i)
+                free_list.tryPush(i);
+        }
+
+        int size() const { return (int)frames.size(); }
+
+        cv::Mat& operator[](int i) { return frames[i]; }
+
+        // Blocks until a buffer is released
+        int acquire()
+        {
+            int i;
+            free_list.pop(i);
+            return i;
+        }
+
+        void release(int i) { free_list.push(i); }
+
+        QueueStats stats() const { return free_list.stats(); }
+
+    private:
+        FramePool(const FramePool& other);
+        FramePool& operator=(const FramePool& other);
+
+        std::vector<cv::Mat> frames;
+        SpscQueue<int> free_list;
+    };
+
+}
+
+#endif /* pipeline_h */
@@ -0,0 +1,267 @@
+//
+//  profile.h
+//  ar-color-balancing
+//
+//  Hot path instrumentation: scoped stage timers and event counters accumulated per
+//  thread without locks, dumped on demand as text or JSON. Compiled in with ARCB_PROFILE.
+//
+
+#ifndef profile_h
+#define profile_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <stdint.h>
+
+namespace profile
+{
+    typedef enum Timer
+    {
+        TIMER_TO_LAB,       // BGR to Lab conversion of the corrected rows
+        TIMER_OFFSETS,      // Lab offsets: lut lookup or RBF evaluation, and their sum
+        TIMER_TO_BGR,       // Lab to BGR conversion of the corrected rows
+        TIMER_EXACT,        // memoized rows of MODE_EXACT, all three steps in one
+        TIMER_FIT,          // RBF fits of new models
+        TIMER_BAKE,         // lut bakes of new models
+        TIMER_READ,         // image and frame reads
+        TIMER_WRITE,        // image and frame writes or display
+        TIMER_SAMPLES,      // color samples file reads
+        NUM_TIMERS
+
+    } Timer;
+
+    typedef enum Counter
+    {
+        COUNTER_PIXELS,         // pixels corrected
+        COUNTER_CACHE_HITS,     // MODE_EXACT pixels served by the color cache
+        COUNTER_CACHE_MISSES,   // MODE_EXACT pixels corrected through the full chain
+        COUNTER_FITS,           // models fitted
+        COUNTER_FRAMES,         // video frames corrected
+        NUM_COUNTERS
+
+    } Counter;
+
+    static inline const char* timerName(int t)
+    {
+        const char* names[] = { "to_lab", "offsets", "to_bgr", "exact", "fit", "bake", "read", "write", "samples" };
+        return names[t];
+    }
+
+    static inline const char* counterName(int c)
+    {
+        const char* names[] = { "pixels", "cache_hits", "cache_misses", "fits", "frames" };
+        return names[c];
+    }
+
+    static inline bool enabled()
+    {
+#ifdef ARCB_PROFILE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    namespace detail
+    {
+        enum { MAX_SLOTS = 256 };
+
+        // One per thread, on its own cache lines. Only the owner thread writes it, so the
+        // relaxed increments never contend; readers sum all slots while they are written.
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> nanoseconds[NUM_TIMERS];
+            std::atomic<uint64_t> calls[NUM_TIMERS];
+            std::atomic<uint64_t> counters[NUM_COUNTERS];
+        };
+
+        // Static storage, zero initialized before any thread runs
+        struct Registry
+        {
+            Slot slots[MAX_SLOTS];
+            std::atomic<int> used;
+        };
+
+        inline Registry& registry()
+        {
+            static Registry r;
+            return r;
+        }
+
+        // Claimed on a thread's first event and kept for the process lifetime, so totals
+        // survive the thread. Threads past MAX_SLOTS share the last slot, still correctly.
+        inline Slot& slot()
+        {
+            static thread_local Slot* s = nullptr;
+
+            if(!s)
+            {
+                const int i = registry().used.fetch_add(1, std::memory_order_relaxed);
+                s = &registry().slots[std::min(i, (int)MAX_SLOTS - 1)];
+            }
+
+            return *s;
+        }
+    }
+
+    inline void count(Counter c, uint64_t n)
+    {
+        detail::slot().counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void addTime(Timer t, uint64_t nanoseconds)
+    {
+        detail::Slot& s = detail::slot();
+        s.nanoseconds[t].fetch_add(nanoseconds, std::memory_order_relaxed);
+        s.calls[t].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the time from construction to destruction to a timer
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(Timer t) : timer(t), start(clock::now()) { }
+
+        ~ScopedTimer()
+        {
+            addTime(timer, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+        }
+
+    private:
+        ScopedTimer(const ScopedTimer& other);
+        ScopedTimer& operator=(const ScopedTimer& other);
+
+        typedef std::chrono::steady_clock clock;
+
+        Timer timer;
+        clock::time_point start;
+    };
+
+    // Totals over all threads. Taken while threads run, it may miss their latest events.
+    struct Snapshot
+    {
+        uint64_t nanoseconds[NUM_TIMERS];
+        uint64_t calls[NUM_TIMERS];
+        uint64_t counters[NUM_COUNTERS];
+        int threads;
+    };
+
+    inline Snapshot snapshot()
+    {
+        Snapshot snap = {};
+
+        if(!enabled())
+            return snap;
+
+        detail::Registry& r = detail::registry();
+        snap.threads = std::min(r.used.load(std::memory_order_relaxed), (int)detail::MAX_SLOTS);
+
+        for(int i = 0; i < snap.threads; ++i)
+        {
+            for(int t = 0; t < NUM_TIMERS; ++t)
+            {
+                snap.nanoseconds[t] += r.slots[i].nanoseconds[t].load(std::memory_order_relaxed);
+                snap.calls[t] += r.slots[i].calls[t].load(std::memory_order_relaxed);
+            }
+
+            for(int c = 0; c < NUM_COUNTERS; ++c)
+                snap.counters[c] += r.slots[i].counters[c].load(std::memory_order_relaxed);
+        }
+
+        return snap;
+    }
+
+    // Zeroes all totals; events racing with it may survive
+    inline void reset()
+    {
+        if(!enabled())
+            return;
+
+        detail::Registry& r = detail::registry();
+        const int used = std::min(r.used.load(std::memory_order_relaxed), (int)detail::MAX_SLOTS);
+
+        for(int i = 0; i < used; ++i)
+        {
+            for(int t = 0; t < NUM_TIMERS; ++t)
+            {
+                r.slots[i].nanoseconds[t].store(0, std::memory_order_relaxed);
+                r.slots[i].calls[t].store(0, std::memory_order_relaxed);
+            }
+
+            for(int c = 0; c < NUM_COUNTERS; ++c)
+                r.slots[i].counters[c].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Timers with their calls, total and mean time and share of the timed total (summed
+    // over threads, so it can exceed the wall time), then the counters
+    inline void printText(FILE* f)
+    {
+        if(!enabled())
+        {
+            fprintf(f, "Profiling not compiled in, build with ARCB_PROFILE.\n");
+            return;
+        }
+
+        const Snapshot snap = snapshot();
+
+        uint64_t total = 0;
+        for(int t = 0; t < NUM_TIMERS; ++t)
+            total += snap.nanoseconds[t];
+
+        fprintf(f, "profile, %d threads\n", snap.threads);
+        fprintf(f, "%-10s %10s %12s %12s %8s\n", "timer", "calls", "total ms", "mean us", "share");
+
+        for(int t = 0; t < NUM_TIMERS; ++t)
+        {
+            if(!snap.calls[t])
+                continue;
+
+            fprintf(f, "%-10s %10llu %12.3f %12.3f %7.1f%%\n", timerName(t), (unsigned long long)snap.calls[t],
+                    snap.nanoseconds[t] * 1e-6, snap.nanoseconds[t] * 1e-3 / snap.calls[t], 100.0 * snap.nanoseconds[t] / total);
+        }
+
+        for(int c = 0; c < NUM_COUNTERS; ++c)
+            fprintf(f, "%-12s %12llu\n", counterName(c), (unsigned long long)snap.counters[c]);
+
+        const uint64_t lookups = snap.counters[COUNTER_CACHE_HITS] + snap.counters[COUNTER_CACHE_MISSES];
+
+        if(lookups)
+            fprintf(f, "cache hit rate %.2f%%\n", 100.0 * snap.counters[COUNTER_CACHE_HITS] / lookups);
+    }
+
+    inline void writeJSON(FILE* f)
+    {
+        const Snapshot snap = snapshot();
+
+        fprintf(f, "{\"enabled\": %s, \"threads\": %d, \"timers\": {", enabled() ? "true" : "false", snap.threads);
+
+        for(int t = 0; t < NUM_TIMERS; ++t)
+            fprintf(f, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu}", t ? ", " : "", timerName(t),
+                    (unsigned long long)snap.calls[t], (unsigned long long)snap.nanoseconds[t]);
+
+        fprintf(f, "}, \"counters\": {");
+
+        for(int c = 0; c < NUM_COUNTERS; ++c)
+            fprintf(f, "%s\"%s\": %llu", c ? ", " : "", counterName(c), (unsigned long long)snap.counters[c]);
+
+        fprintf(f, "}}\n");
+    }
+
+}
+
+// Hot path hooks. Without ARCB_PROFILE they expand to nothing: the arguments are not
+// evaluated and no clock is read.
+#ifdef ARCB_PROFILE
+    #define PROFILE_CONCAT_(a, b) a##b
+    #define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+    #define PROFILE_SCOPE(timer) profile::ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(profile::timer)
+    #define PROFILE_COUNT(counter, n) profile::count(profile::counter, (uint64_t)(n))
+#else
+    #define PROFILE_SCOPE(timer) ((void)0)
+    #define PROFILE_COUNT(counter, n) ((void)sizeof(n))
+#endif
+
+#endif /* profile_h */
@@ -0,0 +1,420 @@
+//
+//  rbfsparse.h
+//  ar-color-balancing
+//
+//  Compactly supported RBF kernels, a uniform grid index over the support points,
+//  and an interpolator fitted with a sparse solver.
+//
+
+#ifndef rbfsparse_h
+#define rbfsparse_h
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <chrono>
+#include <Eigen/Sparse>
+#include <rbf.h>
+
+namespace rbf
+{
+    // Wendland C2 function (1 - r/R)^4 (4 r/R + 1) for r < R, 0 beyond. Positive definite
+    // in up to 3 dimensions, so the kernel matrix is SPD and sparse. radius is in the
+    // units of the points, e.g. Lab.
+    template<typename T>
+    class RBF_fn_Wendland
+    {
+    public:
+        RBF_fn_Wendland() : radius(20), inv_radius(1 / radius) { }
+        RBF_fn_Wendland(const T& in_radius) : radius(in_radius), inv_radius(1 / in_radius) { }
+
+        // no vector form, power() only completes the kernel policy
+        enum { simd_kind = KERNEL_GENERIC };
+        T power() const { return 0; }
+
+        T support() const { return radius; }
+
+        inline T operator()(const T& r) const
+        {
+            const T q = r * inv_radius;
+
+            if(q >= 1)
+                return 0;
+
+            const T t = 1 - q;
+            const T t2 = t * t;
+            return t2 * t2 * (4 * q + 1);
+        }
+
+    private:
+        T radius;
+        T inv_radius;
+    };
+
+    // Buckets points (n x dim, column major) in cells of at least cell_size. Points are
+    // stored by cell in one index array (CSR layout); a radius query with radius <= cell
+    // size visits at most 3^dim cells. The cell size grows when needed to keep the number
+    // of cells below max_cells.
+    template<typename T, const int dim>
+    class UniformGrid
+    {
+    public:
+        enum { MAX_CELLS = 1 << 20 };
+
+        UniformGrid() : n(0), cell(1), inv_cell(1) { }
+
+        void build(const T* pts, const int in_n, T cell_size, const int max_cells = MAX_CELLS)
+        {
+            n = in_n;
+
+            for(int k = 0; k < dim; ++k)
+            {
+                lo[k] = n > 0 ? *std::min_element(pts + k * n, pts + (k + 1) * n) : 0;
+                hi[k] = n > 0 ? *std::max_element(pts + k * n, pts + (k + 1) * n) : 0;
+            }
+
+            assert(std::isfinite(cell_size) && cell_size > 0);
+
+            // no smaller than the cell of max_cells cubes over the widest axis, and the cell
+            // counts are taken in double so that a tiny cell_size can not overflow them
+            T range = 0;
+
+            for(int k = 0; k < dim; ++k)
+                range = std::max(range, hi[k] - lo[k]);
+
+            cell_size = std::max(cell_size, (T)(range / std::pow((double)max_cells, 1.0 / dim)));
+
+            // dims and total come from the same double counts: a quotient in T can round up
+            // to the next integer and give more cells than total
+            int total;
+
+            for(;;)
+            {
+                double cells = 1;
+                double counts[dim];
+
+                for(int k = 0; k < dim; ++k)
+                {
+                    counts[k] = std::floor((hi[k] - lo[k]) / (double)cell_size) + 1;
+                    cells *= counts[k];
+                }
+
+                if(cells <= max_cells)
+                {
+                    total = 1;
+
+                    for(int k = 0; k < dim; ++k)
+                    {
+                        dims[k] = (int)counts[k];
+                        total *= dims[k];
+                    }
+
+                    break;
+                }
+
+                cell_size *= 2;
+            }
+
+            cell = cell_size;
+            inv_cell = 1 / cell_size;
+
+            start.assign(total + 1, 0);
+            index.resize(n);
+
+            std::vector<int> cell_of(n);
+
+            for(int i = 0; i < n; ++i)
+            {
+                int c = 0;
+
+                for(int k = 0; k < dim; ++k)
+                    c = c * dims[k] + coord(pts[k * n + i], k);
+
+                assert(c < total);
+                cell_of[i] = c;
+                ++start[c + 1];
+            }
+
+            for(int c = 0; c < total; ++c)
+                start[c + 1] += start[c];
+
+            std::vector<int> fill(start.begin(), start.end() - 1);
+
+            for(int i = 0; i < n; ++i)
+                index[fill[cell_of[i]]++] = i;
+        }
+
+        // Calls fn(int i) for the points in the cells overlapping the box of half side
+        // radius around x. Callers test the actual distance.
+        template<typename TFn>
+        inline void query(const T* x, const T radius, TFn& fn) const
+        {
+            int from[dim], to[dim], c[dim];
+
+            for(int k = 0; k < dim; ++k)
+            {
+                from[k] = coord(x[k] - radius, k);
+                to[k] = coord(x[k] + radius, k);
+
+                if(x[k] + radius < lo[k] || x[k] - radius > hi[k])
+                    return;
+
+                c[k] = from[k];
+            }
+
+            for(;;)
+            {
+                int id = 0;
+
+                for(int k = 0; k < dim; ++k)
+                    id = id * dims[k] + c[k];
+
+                for(int s = start[id]; s < start[id + 1]; ++s)
+                    fn(index[s]);
+
+                int k = dim - 1;
+
+                while(k >= 0 && c[k] == to[k])
+                {
+                    c[k] = from[k];
+                    --k;
+                }
+
+                if(k < 0)
+                    break;
+
+                ++c[k];
+            }
+        }
+
+        T cellSize() const { return cell; }
+
+    private:
+        inline int coord(T v, int k) const
+        {
+            int c = (int)std::floor((v - lo[k]) * inv_cell);
+            return std::min(std::max(c, 0), dims[k] - 1);
+        }
+
+        int n;
+        T cell;
+        T inv_cell;
+        T lo[dim];
+        T hi[dim];
+        int dims[dim];
+
+        std::vector<int> start;
+        std::vector<int> index;
+    };
+
+    // Same model as RBF_multi_interpolation for kernels with compact support (TRBF_fn<T>
+    // must provide support()). The kernel matrix only holds the pairs closer than the
+    // support radius and is factored with a sparse LDLT, falling back to sparse LU. An
+    // evaluation only visits the support points in the neighbouring grid cells, so its
+    // cost depends on the local sample density rather than on n. Queries with no support
+    // point in range evaluate to 0.
+    template<typename T, const int dim, const int odim, template<typename> class TRBF_fn>
+    class RBF_sparse_interpolation
+    {
+    public:
+
+        RBF_sparse_interpolation(const Eigen::Matrix<T, Eigen::Dynamic, dim>& in_pts,
+                                 const Eigen::Matrix<T, Eigen::Dynamic, odim>& in_vals,
+                                 bool in_normalize,
+                                 const TRBF_fn<T>& in_fn = TRBF_fn<T>()) : fn(in_fn), normalize(in_normalize)
+        {
+            n = in_pts.rows();
+            assert(n == in_vals.rows());
+
+            pts = Eigen::Matrix<T, Eigen::Dynamic, dim>(in_pts);
+            vals = Eigen::Matrix<T, Eigen::Dynamic, odim>(in_vals);
+            radius = fn.support();
+
+            grid.build(pts.data(), n, radius);
+
+            std::vector<Eigen::Triplet<T> > entries;
+            Eigen::Matrix<T, Eigen::Dynamic, 1> sums = Eigen::Matrix<T, Eigen::Dynamic, 1>::Zero(n);
+
+            for(int i = 0; i < n; ++i)
+            {
+                T x[dim];
+
+                for(int k = 0; k < dim; ++k)
+                    x[k] = pts(i, k);
+
+                struct Collect
+                {
+                    const RBF_sparse_interpolation* self;
+                    const T* x;
+                    int i;
+                    std::vector<Eigen::Triplet<T> >* entries;
+                    T sum;
+
+                    void operator()(int j)
+                    {
+                        T v = self->fn(self->distance(x, j));
+
+                        if(v != 0)
+                        {
+                            entries->push_back(Eigen::Triplet<T>(i, j, v));
+                            sum += v;
+                        }
+                    }
+                } collect = { this, x, i, &entries, 0 };
+
+                grid.query(x, radius, collect);
+                sums(i) = collect.sum;
+            }
+
+            Eigen::SparseMatrix<T> rbf(n, n);
+            rbf.setFromTriplets(entries.begin(), entries.end());
+
+            Eigen::Matrix<T, Eigen::Dynamic, odim> rhs(n, odim);
+
+            if(normalize)
+                rhs = sums.asDiagonal() * vals;
+            else
+                rhs = vals;
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            Eigen::SimplicialLDLT<Eigen::SparseMatrix<T> > ldlt(rbf);
+            report.solver = SOLVER_SPARSE_LDLT;
+
+            if(Eigen::Success == ldlt.info())
+                w = ldlt.solve(rhs);
+
+            if(Eigen::Success != ldlt.info() || !w.allFinite())
+            {
+                Eigen::SparseLU<Eigen::SparseMatrix<T> > lu;
+                lu.analyzePattern(rbf);
+                lu.factorize(rbf);
+                w = lu.solve(rhs);
+                report.solver = SOLVER_SPARSE_LU;
+            }
+
+            report.num_samples = n;
+            report.solve_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            report.relative_residual = (rbf * w - rhs).norm() / rhs.norm();
+            nonzeros = (int)rbf.nonZeros();
+        }
+
+        // Restores a fitted interpolator from its n support points and weights, both column
+        // major (n x dim, n x odim). Only the grid is rebuilt, nothing is solved.
+        RBF_sparse_interpolation(const T* in_pts,
+                                 const T* in_w,
+                                 int in_n,
+                                 bool in_normalize,
+                                 const TRBF_fn<T>& in_fn,
+                                 const FitReport& in_report) : n(in_n), nonzeros(0), fn(in_fn), normalize(in_normalize), report(in_report)
+        {
+            pts = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, dim> >(in_pts, n, dim);
+            w = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, odim> >(in_w, n, odim);
+            radius = fn.support();
+
+            grid.build(pts.data(), n, radius);
+        }
+
+        Eigen::Matrix<T, 1, odim> interpolate(const Eigen::Matrix<T, 1, dim>& in_pt) const
+        {
+            Eigen::Matrix<T, 1, odim> result;
+            evaluate(in_pt.data(), result.data());
+            return result;
+        }
+
+        // Evaluates count points given as dim coordinate arrays (structure of arrays)
+        // into odim output arrays
+        void interpolate(const T* const* in, T* const* out, const int count) const
+        {
+            T x[dim], y[odim];
+
+            for(int q = 0; q < count; ++q)
+            {
+                for(int k = 0; k < dim; ++k)
+                    x[k] = in[k][q];
+
+                evaluate(x, y);
+
+                for(int o = 0; o < odim; ++o)
+                    out[o][q] = y[o];
+            }
+        }
+
+        int size() const { return n; }
+        int nonZeros() const { return nonzeros; }
+        const FitReport& fitReport() const { return report; }
+        const Eigen::Matrix<T, Eigen::Dynamic, dim>& points() const { return pts; }
+        const Eigen::Matrix<T, Eigen::Dynamic, odim>& weights() const { return w; }
+        const TRBF_fn<T>& kernel() const { return fn; }
+        bool normalized() const { return normalize; }
+
+    private:
+        RBF_sparse_interpolation(const RBF_sparse_interpolation& other);
+        RBF_sparse_interpolation& operator=(const RBF_sparse_interpolation& other);
+
+        inline T distance(const T* x, int j) const
+        {
+            T r2 = 0;
+
+            for(int k = 0; k < dim; ++k)
+            {
+                T v = x[k] - pts(j, k);
+                r2 += v * v;
+            }
+
+            return std::sqrt(r2);
+        }
+
+        // One query point x, odim outputs in y
+        inline void evaluate(const T* x, T* y) const
+        {
+            struct Accumulate
+            {
+                const RBF_sparse_interpolation* self;
+                const T* x;
+                T sumw[odim];
+                T sum;
+
+                void operator()(int j)
+                {
+                    T v = self->fn(self->distance(x, j));
+                    sum += v;
+
+                    for(int o = 0; o < odim; ++o)
+                        sumw[o] += self->w(j, o) * v;
+                }
+            } acc;
+
+            acc.self = this;
+            acc.x = x;
+            acc.sum = 0;
+            std::fill(acc.sumw, acc.sumw + odim, (T)0);
+
+            grid.query(x, radius, acc);
+
+            for(int o = 0; o < odim; ++o)
+                y[o] = !normalize ? acc.sumw[o] : (acc.sum > 0 ? acc.sumw[o] / acc.sum : (T)0);
+        }
+
+        Eigen::Matrix<T, Eigen::Dynamic, dim> pts;
+        Eigen::Matrix<T, Eigen::Dynamic, odim> vals;
+
+        Eigen::Matrix<T, Eigen::Dynamic, odim> w;
+
+        UniformGrid<T, dim> grid;
+
+        int n;
+        int nonzeros;
+
+        TRBF_fn<T> fn;
+        T radius;
+
+        bool normalize;
+
+        FitReport report;
+    };
+
+}
+
+#endif /* rbfsparse_h */
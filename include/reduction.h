@@ -0,0 +1,377 @@
+//
+//  reduction.h
+//  ar-color-balancing
+//
+//  Preprocessing of color samples before a fit: outlier rejection against an affine
+//  color model, merging of near duplicates in Lab and k-means down to a budget.
+//
+
+#ifndef reduction_h
+#define reduction_h
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+#include <Eigen/Dense>
+#include <colors.h>
+
+namespace reduction
+{
+    struct ReductionOptions
+    {
+        // RANSAC: samples farther than this from the best affine Lab -> Lab model (in Lab
+        // units, Delta E 76) are dropped. 0 disables outlier rejection.
+        float outlier_threshold;
+        int ransac_iterations;
+
+        // Samples whose source colors share a Lab cube of this side are merged into their
+        // average. 0 disables merging; sides below color::LabCellMin are raised to it.
+        float merge_distance;
+
+        // Largest number of samples kept, reached by weighted k-means on the source Lab
+        // colors. 0 for no limit.
+        int budget;
+        int kmeans_iterations;
+
+        unsigned int seed;      // RANSAC and k-means draws, for reproducible results
+
+        ReductionOptions() : outlier_threshold(15.0f), ransac_iterations(256), merge_distance(2.0f),
+                             budget(0), kmeans_iterations(16), seed(1) { }
+    };
+
+    struct ReductionReport
+    {
+        int input;
+        int outliers;           // rejected by RANSAC
+        int merged;             // left after merging
+        int output;             // left after k-means
+    };
+
+    namespace detail
+    {
+        // A sample as Lab source and target, its RGB average and how many inputs it stands for
+        struct LabSample
+        {
+            float src[3];
+            float dst[3];
+            float rgb[6];
+            float weight;
+        };
+
+        static void toLabSamples(const unsigned char* rgb_pairs, int n, std::vector<LabSample>& samples)
+        {
+            std::vector<float> lab(n * 6);
+            color::RGBPairs_to_Lab(rgb_pairs, lab.data(), n);
+
+            samples.resize(n);
+
+            for(int i = 0; i < n; ++i)
+            {
+                for(int c = 0; c < 3; ++c)
+                {
+                    samples[i].src[c] = lab[i * 6 + c];
+                    samples[i].dst[c] = lab[i * 6 + 3 + c];
+                }
+
+                for(int c = 0; c < 6; ++c)
+                    samples[i].rgb[c] = rgb_pairs[i * 6 + c];
+
+                samples[i].weight = 1.0f;
+            }
+        }
+
+        // Least squares affine map [src 1] * M = dst over the given samples
+        static bool fitAffine(const std::vector<LabSample>& samples, const int* indices, int count, Eigen::Matrix<float, 4, 3>& M)
+        {
+            Eigen::Matrix<float, Eigen::Dynamic, 4> A(count, 4);
+            Eigen::Matrix<float, Eigen::Dynamic, 3> B(count, 3);
+
+            for(int i = 0; i < count; ++i)
+            {
+                const LabSample& s = samples[indices[i]];
+                A.row(i) << s.src[0], s.src[1], s.src[2], 1.0f;
+                B.row(i) << s.dst[0], s.dst[1], s.dst[2];
+            }
+
+            Eigen::ColPivHouseholderQR<Eigen::Matrix<float, Eigen::Dynamic, 4> > qr(A);
+
+            if(qr.rank() < 4)
+                return false;
+
+            M = qr.solve(B);
+            return M.allFinite();
+        }
+
+        static inline float affineError(const LabSample& s, const Eigen::Matrix<float, 4, 3>& M)
+        {
+            float e2 = 0.0f;
+
+            for(int c = 0; c < 3; ++c)
+            {
+                float v = s.src[0] * M(0, c) + s.src[1] * M(1, c) + s.src[2] * M(2, c) + M(3, c) - s.dst[c];
+                e2 += v * v;
+            }
+
+            return std::sqrt(e2);
+        }
+
+        // Keeps the inliers of the affine model with the most of them among random minimal
+        // fits, refit on its inliers. Returns the number of samples dropped.
+        static int rejectOutliers(std::vector<LabSample>& samples, const ReductionOptions& options, std::mt19937& rng)
+        {
+            const int n = (int)samples.size();
+
+            if(options.outlier_threshold <= 0.0f || n < 8)
+                return 0;
+
+            std::uniform_int_distribution<int> pick(0, n - 1);
+            Eigen::Matrix<float, 4, 3> M, best;
+            int best_inliers = -1;
+
+            for(int it = 0; it < options.ransac_iterations; ++it)
+            {
+                int minimal[4];
+
+                for(int k = 0; k < 4; ++k)
+                    minimal[k] = pick(rng);
+
+                if(!fitAffine(samples, minimal, 4, M))
+                    continue;
+
+                int inliers = 0;
+
+                for(int i = 0; i < n; ++i)
+                    inliers += affineError(samples[i], M) <= options.outlier_threshold;
+
+                if(inliers > best_inliers)
+                {
+                    best_inliers = inliers;
+                    best = M;
+                }
+            }
+
+            if(best_inliers < 4)
+                return 0;
+
+            std::vector<int> inliers;
+
+            for(int i = 0; i < n; ++i)
+                if(affineError(samples[i], best) <= options.outlier_threshold)
+                    inliers.push_back(i);
+
+            if(fitAffine(samples, &inliers[0], (int)inliers.size(), M))
+                best = M;
+
+            std::vector<LabSample> kept;
+            kept.reserve(n);
+
+            for(int i = 0; i < n; ++i)
+                if(affineError(samples[i], best) <= options.outlier_threshold)
+                    kept.push_back(samples[i]);
+
+            // a refit that loses most of the consensus means no affine trend to speak of
+            if((int)kept.size() * 2 < best_inliers)
+                return 0;
+
+            const int dropped = n - (int)kept.size();
+            samples.swap(kept);
+            return dropped;
+        }
+
+        // Weighted average of b into a
+        static inline void accumulate(LabSample& a, const LabSample& b)
+        {
+            const float w = b.weight / (a.weight + b.weight);
+
+            for(int c = 0; c < 3; ++c)
+            {
+                a.src[c] += (b.src[c] - a.src[c]) * w;
+                a.dst[c] += (b.dst[c] - a.dst[c]) * w;
+            }
+
+            for(int c = 0; c < 6; ++c)
+                a.rgb[c] += (b.rgb[c] - a.rgb[c]) * w;
+
+            a.weight += b.weight;
+        }
+
+        // Merges the samples whose source colors share a Lab cube of side cell, in first seen order
+        static void gridMerge(std::vector<LabSample>& samples, float cell)
+        {
+            color::MergeInLabCells(samples, cell,
+                                   [&](size_t i) { return samples[i].src; },
+                                   [](LabSample& first, const LabSample& s) { accumulate(first, s); });
+        }
+
+        static inline float distance2(const float* a, const float* b)
+        {
+            float d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+            return d0 * d0 + d1 * d1 + d2 * d2;
+        }
+
+        // Weighted k-means on the source colors, seeded with k-means++. Each cluster becomes
+        // the weighted average of its members; empty clusters disappear.
+        static void kmeans(std::vector<LabSample>& samples, int k, int iterations, std::mt19937& rng)
+        {
+            const int n = (int)samples.size();
+
+            if(k <= 0 || n <= k)
+                return;
+
+            std::vector<int> centers;
+            std::vector<float> nearest(n, std::numeric_limits<float>::max());
+            std::vector<float> centroids;
+
+            centers.push_back(std::uniform_int_distribution<int>(0, n - 1)(rng));
+
+            while((int)centers.size() < k)
+            {
+                const float* c = samples[centers.back()].src;
+                double total = 0.0;
+
+                for(int i = 0; i < n; ++i)
+                {
+                    nearest[i] = std::min(nearest[i], distance2(samples[i].src, c));
+                    total += nearest[i] * samples[i].weight;
+                }
+
+                if(total <= 0.0)
+                    break;
+
+                double r = std::uniform_real_distribution<double>(0.0, total)(rng);
+                int next = n - 1;
+
+                for(int i = 0; i < n; ++i)
+                {
+                    r -= nearest[i] * samples[i].weight;
+
+                    if(r <= 0.0)
+                    {
+                        next = i;
+                        break;
+                    }
+                }
+
+                centers.push_back(next);
+            }
+
+            const int m = (int)centers.size();
+            centroids.resize(m * 3);
+
+            for(int j = 0; j < m; ++j)
+                std::copy(samples[centers[j]].src, samples[centers[j]].src + 3, &centroids[j * 3]);
+
+            // at least one pass, which assigns every sample to its nearest center
+            std::vector<int> label(n, -1);
+
+            for(int it = 0; it < std::max(1, iterations); ++it)
+            {
+                bool changed = false;
+
+                for(int i = 0; i < n; ++i)
+                {
+                    int best = 0;
+                    float best_d = std::numeric_limits<float>::max();
+
+                    for(int j = 0; j < m; ++j)
+                    {
+                        float d = distance2(samples[i].src, &centroids[j * 3]);
+
+                        if(d < best_d)
+                        {
+                            best_d = d;
+                            best = j;
+                        }
+                    }
+
+                    changed = changed || label[i] != best;
+                    label[i] = best;
+                }
+
+                if(!changed)
+                    break;
+
+                std::vector<double> sums(m * 4, 0.0);
+
+                for(int i = 0; i < n; ++i)
+                {
+                    double* s = &sums[label[i] * 4];
+
+                    for(int c = 0; c < 3; ++c)
+                        s[c] += samples[i].src[c] * samples[i].weight;
+
+                    s[3] += samples[i].weight;
+                }
+
+                for(int j = 0; j < m; ++j)
+                    if(sums[j * 4 + 3] > 0.0)
+                        for(int c = 0; c < 3; ++c)
+                            centroids[j * 3 + c] = (float)(sums[j * 4 + c] / sums[j * 4 + 3]);
+            }
+
+            std::vector<LabSample> clusters;
+            std::vector<int> cluster_of(m, -1);
+
+            for(int i = 0; i < n; ++i)
+            {
+                int& c = cluster_of[label[i]];
+
+                if(c < 0)
+                {
+                    c = (int)clusters.size();
+                    clusters.push_back(samples[i]);
+                }
+                else
+                {
+                    accumulate(clusters[c], samples[i]);
+                }
+            }
+
+            samples.swap(clusters);
+        }
+    }
+
+    // Reduces num_samples color samples (source RGB then target RGB) to out_pairs: outliers
+    // of the affine trend are dropped first, then near duplicates merged, then k-means caps
+    // the count at the budget. Merged samples average their RGB colors. Deterministic for a
+    // given seed.
+    static ReductionReport reduceSamples(const unsigned char* rgb_pairs,
+                                         int num_samples,
+                                         const ReductionOptions& options,
+                                         std::vector<unsigned char>& out_pairs)
+    {
+        ReductionReport report = { num_samples, 0, num_samples, num_samples };
+
+        if(num_samples < 1)
+        {
+            out_pairs.clear();
+            return report;
+        }
+
+        std::vector<detail::LabSample> samples;
+        detail::toLabSamples(rgb_pairs, num_samples, samples);
+
+        std::mt19937 rng(options.seed);
+
+        report.outliers = detail::rejectOutliers(samples, options, rng);
+
+        detail::gridMerge(samples, options.merge_distance);
+        report.merged = (int)samples.size();
+
+        detail::kmeans(samples, options.budget, options.kmeans_iterations, rng);
+        report.output = (int)samples.size();
+
+        out_pairs.resize(samples.size() * 6);
+
+        for(size_t i = 0; i < samples.size(); ++i)
+            for(int c = 0; c < 6; ++c)
+                out_pairs[i * 6 + c] = (unsigned char)std::min(255.0f, samples[i].rgb[c] + 0.5f);
+
+        return report;
+    }
+
+}
+
+#endif /* reduction_h */
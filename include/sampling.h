@@ -0,0 +1,202 @@
+//
+//  sampling.h
+//  ar-color-balancing
+//
+//  Automatic extraction of color correspondences from an aligned image pair.
+//
+
+#ifndef sampling_h
+#define sampling_h
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <colors.h>
+#include <parallel.h>
+#include <opencv2/opencv.hpp>
+
+namespace sampling
+{
+    typedef enum PatchSelection
+    {
+        PATCHES_GRID,           // every patch of the grid
+        PATCHES_UNIFORM,        // only the patches flat in both images, e.g. inside checker squares
+
+    } PatchSelection;
+
+    struct SamplerOptions
+    {
+        int patch_size;         // side of the averaged square patches, in pixels
+        int stride;             // distance between patches, 0 for patch_size
+        PatchSelection selection;
+
+        // PATCHES_UNIFORM: largest standard deviation, in 8 bit levels, of any channel of a
+        // patch in either image. Patches straddling an edge or misaligned are rejected.
+        float max_deviation;
+
+        // Correspondences whose source colors fall in the same Lab cube of this side are
+        // merged into their average, 0 keeps them all. Sides below color::LabCellMin are
+        // raised to it.
+        float merge_distance;
+
+        int num_threads;        // 0 uses the shared default pool
+
+        SamplerOptions() : patch_size(8), stride(0), selection(PATCHES_UNIFORM), max_deviation(4.0f),
+                           merge_distance(2.0f), num_threads(0) { }
+    };
+
+    namespace detail
+    {
+        // Mean source and target colors of one patch, BGR, and how many patches it stands for
+        struct PatchMean
+        {
+            float src[3];
+            float dst[3];
+            int count;
+        };
+
+        // Means of the patch at (x, y) in both images; with check_deviation, false when the
+        // standard deviation of any channel exceeds max_deviation
+        static inline bool averagePatch(const cv::Mat& source, const cv::Mat& target, int x, int y, int size,
+                                        float max_deviation, bool check_deviation, PatchMean& mean)
+        {
+            double sum[6] = { 0 }, sq[6] = { 0 };
+
+            for(int r = y; r < y + size; ++r)
+            {
+                const unsigned char* s = source.ptr<unsigned char>(r) + x * 3;
+                const unsigned char* t = target.ptr<unsigned char>(r) + x * 3;
+
+                for(int i = 0; i < size * 3; i += 3)
+                {
+                    for(int c = 0; c < 3; ++c)
+                    {
+                        sum[c] += s[i + c];
+                        sq[c] += s[i + c] * s[i + c];
+                        sum[c + 3] += t[i + c];
+                        sq[c + 3] += t[i + c] * t[i + c];
+                    }
+                }
+            }
+
+            const double inv = 1.0 / (size * size);
+
+            for(int c = 0; c < 6; ++c)
+            {
+                const double m = sum[c] * inv;
+
+                if(check_deviation && sq[c] * inv - m * m > (double)max_deviation * max_deviation)
+                    return false;
+
+                (c < 3 ? mean.src[c] : mean.dst[c - 3]) = (float)m;
+            }
+
+            mean.count = 1;
+            return true;
+        }
+
+        // Merges patches whose source Lab colors share a cube of side cell, in first seen order
+        static void mergeInLab(std::vector<PatchMean>& patches, float cell)
+        {
+            if(patches.empty() || cell <= 0.0f)
+                return;
+
+            // 3 channels, blue first
+            color::RGB2Lab<float> toLab(3, 0, nullptr, nullptr, true);
+
+            std::vector<float> bgr(patches.size() * 3), lab(patches.size() * 3);
+
+            for(size_t i = 0; i < patches.size(); ++i)
+                for(int c = 0; c < 3; ++c)
+                    bgr[i * 3 + c] = patches[i].src[c] / 255.0f;
+
+            toLab.convert(&bgr[0], &lab[0], (int)patches.size());
+
+            color::MergeInLabCells(patches, cell,
+                                   [&](size_t i) { return &lab[i * 3]; },
+                                   [](PatchMean& m, const PatchMean& p)
+            {
+                const float w = 1.0f / (m.count + 1);
+
+                for(int c = 0; c < 3; ++c)
+                {
+                    m.src[c] += (p.src[c] - m.src[c]) * w;
+                    m.dst[c] += (p.dst[c] - m.dst[c]) * w;
+                }
+
+                ++m.count;
+            });
+        }
+    }
+
+    // Averages aligned patches of two 8 bit BGR images of the same size and writes the
+    // correspondences to rgb_pairs as color samples (source RGB then target RGB), in
+    // raster order of their first patch. Rows of patches are processed in parallel; the
+    // result does not depend on the number of threads. Returns the number of samples,
+    // or -1 if the images do not match.
+    static int extractCorrespondences(const cv::Mat& source,
+                                      const cv::Mat& target,
+                                      const SamplerOptions& options,
+                                      std::vector<unsigned char>& rgb_pairs)
+    {
+        rgb_pairs.clear();
+
+        if(source.size() != target.size() || source.type() != CV_8UC3 || target.type() != CV_8UC3 || options.patch_size < 1)
+            return -1;
+
+        const int size = options.patch_size;
+        const int stride = options.stride > 0 ? options.stride : size;
+        const int rows = source.rows >= size ? (source.rows - size) / stride + 1 : 0;
+        const int cols = source.cols >= size ? (source.cols - size) / stride + 1 : 0;
+        const bool check_deviation = PATCHES_UNIFORM == options.selection;
+
+        std::vector<std::vector<detail::PatchMean> > bands(rows);
+
+        parallel::ThreadPool* pool = &parallel::defaultPool();
+        std::unique_ptr<parallel::ThreadPool> own;
+
+        if(options.num_threads > 0)
+        {
+            own.reset(new parallel::ThreadPool(options.num_threads));
+            pool = own.get();
+        }
+
+        pool->run(rows, [&](int row, int)
+        {
+            std::vector<detail::PatchMean>& band = bands[row];
+            band.reserve(cols);
+
+            detail::PatchMean mean;
+
+            for(int col = 0; col < cols; ++col)
+                if(detail::averagePatch(source, target, col * stride, row * stride, size, options.max_deviation, check_deviation, mean))
+                    band.push_back(mean);
+        });
+
+        std::vector<detail::PatchMean> patches;
+
+        for(int row = 0; row < rows; ++row)
+            patches.insert(patches.end(), bands[row].begin(), bands[row].end());
+
+        detail::mergeInLab(patches, options.merge_distance);
+
+        const int n = (int)patches.size();
+        rgb_pairs.resize(n * 6);
+
+        for(int i = 0; i < n; ++i)
+        {
+            for(int c = 0; c < 3; ++c)
+            {
+                // BGR means to RGB samples
+                rgb_pairs[i * 6 + c] = (unsigned char)std::min(255.0f, patches[i].src[2 - c] + 0.5f);
+                rgb_pairs[i * 6 + 3 + c] = (unsigned char)std::min(255.0f, patches[i].dst[2 - c] + 0.5f);
+            }
+        }
+
+        return n;
+    }
+
+}
+
+#endif /* sampling_h */
@@ -0,0 +1,318 @@
+//
+//  simd.h
+//  ar-color-balancing
+//
+//  SSE2 / AVX2 helpers with runtime CPU detection. Code paths using AVX2 are
+//  compiled per function (target attribute), so the binary still runs on CPUs
+//  without it, falling back to SSE2 or plain scalar code.
+//
+
+#ifndef simd_h
+#define simd_h
+
+#include <atomic>
+#include <mathext.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define ARCB_SIMD_X86 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define ARCB_TARGET_AVX2
+    #else
+        #define ARCB_TARGET_AVX2 __attribute__((target("avx2,fma")))
+    #endif
+#else
+    #define ARCB_SIMD_X86 0
+    #define ARCB_TARGET_AVX2
+#endif
+
+namespace simd
+{
+    typedef enum Level
+    {
+        SCALAR = 0,
+        SSE2,
+        AVX2,
+
+    } Level;
+
+    static inline Level detectLevel()
+    {
+#if ARCB_SIMD_X86
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if(info[0] < 7)
+            return SSE2;
+
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        const bool ymm = osxsave && ((_xgetbv(0) & 6) == 6);
+
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5)) != 0;
+
+        return (ymm && fma && avx2) ? AVX2 : SSE2;
+    #else
+        __builtin_cpu_init();
+        return (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? AVX2 : SSE2;
+    #endif
+#else
+        return SCALAR;
+#endif
+    }
+
+    static inline std::atomic<int>& forcedLevel()
+    {
+        static std::atomic<int> level(AVX2);
+        return level;
+    }
+
+    // Caps the level used by the dispatchers, e.g. to compare paths against each other
+    static inline void forceLevel(Level level)
+    {
+        forcedLevel().store(level);
+    }
+
+    // Best level supported both by the running CPU and by forceLevel()
+    static inline Level level()
+    {
+        static const Level detected = detectLevel();
+        const int forced = forcedLevel().load(std::memory_order_relaxed);
+        return forced < detected ? (Level)forced : detected;
+    }
+
+#if ARCB_SIMD_X86
+
+    // Polynomial log2 / exp2 after Cephes logf / exp2f, relative error ~1e-7 on normal inputs
+
+    namespace sse
+    {
+        static inline __m128 log2_ps(__m128 x)
+        {
+            x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000))); // smallest normal
+
+            __m128i bits = _mm_castps_si128(x);
+            __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+            __m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff))), _mm_set1_ps(1.0f));
+
+            // m in [sqrt(0.5), sqrt(2))
+            __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+            m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))));
+            e = _mm_add_ps(e, _mm_and_ps(big, _mm_set1_ps(1.0f)));
+
+            __m128 f = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+            __m128 z = _mm_mul_ps(f, f);
+
+            __m128 y = _mm_set1_ps(7.0376836292E-2f);
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(-1.1514610310E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.1676998740E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(-1.2420140846E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.4249322787E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(-1.6668057665E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(2.0000714765E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(-2.4999993993E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(3.3333331174E-1f));
+            y = _mm_mul_ps(_mm_mul_ps(y, f), z);
+            y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+
+            __m128 ln = _mm_add_ps(f, y);
+            return _mm_add_ps(_mm_mul_ps(ln, _mm_set1_ps(1.44269504088896341f)), e);
+        }
+
+        static inline __m128 exp2_ps(__m128 x)
+        {
+            x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(126.0f));
+
+            __m128i i = _mm_cvtps_epi32(x); // round to nearest, f in [-0.5, 0.5]
+            __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+
+            __m128 y = _mm_set1_ps(1.535336188319500E-4f);
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.339887440266574E-3f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(9.618437357674640E-3f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(5.550332471162809E-2f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(2.402264791363012E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(6.931472028550421E-1f));
+            y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.0f));
+
+            __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+            return _mm_mul_ps(y, scale);
+        }
+
+        // x^y for x > 0
+        static inline __m128 pow_ps(__m128 x, __m128 y)
+        {
+            return exp2_ps(_mm_mul_ps(y, log2_ps(x)));
+        }
+        
+        // Vector forms of mathext::fastLog2 / fastExp2 / fastPow, same polynomials and error bounds
+        
+        static inline __m128 fastLog2_ps(__m128 x)
+        {
+            const float* c = mathext::FastLog2Poly;
+            
+            __m128i bits = _mm_castps_si128(x);
+            __m128i ei = _mm_srai_epi32(_mm_sub_epi32(bits, _mm_set1_epi32(0x3f3504f3)), 23);
+            __m128 m = _mm_castsi128_ps(_mm_sub_epi32(bits, _mm_slli_epi32(ei, 23)));
+            __m128 e = _mm_cvtepi32_ps(ei);
+            
+            __m128 f = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+            __m128 p = _mm_set1_ps(c[5]);
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[4]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[3]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[2]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[1]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[0]));
+            
+            return _mm_add_ps(_mm_mul_ps(p, f), e);
+        }
+        
+        static inline __m128 fastExp2_ps(__m128 x)
+        {
+            const float* c = mathext::FastExp2Poly;
+            
+            x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(126.0f));
+            
+            __m128i i = _mm_cvtps_epi32(x);
+            __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+            
+            __m128 p = _mm_set1_ps(c[3]);
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[2]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[1]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c[0]));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+            
+            __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+            return _mm_mul_ps(p, scale);
+        }
+        
+        static inline __m128 fastPow_ps(__m128 x, __m128 y)
+        {
+            return fastExp2_ps(_mm_mul_ps(y, fastLog2_ps(x)));
+        }
+        
+        // Cube root for x > 0: fastPow seed refined by one Newton step, relative error ~1e-7
+        static inline __m128 cbrt_ps(__m128 x)
+        {
+            __m128 y = fastPow_ps(x, _mm_set1_ps(1.0f / 3.0f));
+            __m128 y2 = _mm_mul_ps(y, y);
+            return _mm_add_ps(y, _mm_mul_ps(_mm_sub_ps(_mm_div_ps(x, y2), y), _mm_set1_ps(1.0f / 3.0f)));
+        }
+    }
+
+    namespace avx2
+    {
+        ARCB_TARGET_AVX2 static inline __m256 log2_ps(__m256 x)
+        {
+            x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));
+
+            __m256i bits = _mm256_castps_si256(x);
+            __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+            __m256 m = _mm256_or_ps(_mm256_castsi256_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff))), _mm256_set1_ps(1.0f));
+
+            __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+            m = _mm256_sub_ps(m, _mm256_and_ps(big, _mm256_mul_ps(m, _mm256_set1_ps(0.5f))));
+            e = _mm256_add_ps(e, _mm256_and_ps(big, _mm256_set1_ps(1.0f)));
+
+            __m256 f = _mm256_sub_ps(m, _mm256_set1_ps(1.0f));
+            __m256 z = _mm256_mul_ps(f, f);
+
+            __m256 y = _mm256_set1_ps(7.0376836292E-2f);
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(-1.1514610310E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(1.1676998740E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(-1.2420140846E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(1.4249322787E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(-1.6668057665E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(2.0000714765E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(-2.4999993993E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(3.3333331174E-1f));
+            y = _mm256_mul_ps(_mm256_mul_ps(y, f), z);
+            y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+
+            __m256 ln = _mm256_add_ps(f, y);
+            return _mm256_fmadd_ps(ln, _mm256_set1_ps(1.44269504088896341f), e);
+        }
+
+        ARCB_TARGET_AVX2 static inline __m256 exp2_ps(__m256 x)
+        {
+            x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(126.0f));
+
+            __m256i i = _mm256_cvtps_epi32(x);
+            __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+
+            __m256 y = _mm256_set1_ps(1.535336188319500E-4f);
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(1.339887440266574E-3f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(9.618437357674640E-3f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(5.550332471162809E-2f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(2.402264791363012E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(6.931472028550421E-1f));
+            y = _mm256_fmadd_ps(y, f, _mm256_set1_ps(1.0f));
+
+            __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23));
+            return _mm256_mul_ps(y, scale);
+        }
+
+        ARCB_TARGET_AVX2 static inline __m256 pow_ps(__m256 x, __m256 y)
+        {
+            return exp2_ps(_mm256_mul_ps(y, log2_ps(x)));
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 fastLog2_ps(__m256 x)
+        {
+            const float* c = mathext::FastLog2Poly;
+            
+            __m256i bits = _mm256_castps_si256(x);
+            __m256i ei = _mm256_srai_epi32(_mm256_sub_epi32(bits, _mm256_set1_epi32(0x3f3504f3)), 23);
+            __m256 m = _mm256_castsi256_ps(_mm256_sub_epi32(bits, _mm256_slli_epi32(ei, 23)));
+            __m256 e = _mm256_cvtepi32_ps(ei);
+            
+            __m256 f = _mm256_sub_ps(m, _mm256_set1_ps(1.0f));
+            __m256 p = _mm256_set1_ps(c[5]);
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[4]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[3]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[2]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[1]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[0]));
+            
+            return _mm256_fmadd_ps(p, f, e);
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 fastExp2_ps(__m256 x)
+        {
+            const float* c = mathext::FastExp2Poly;
+            
+            x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(126.0f));
+            
+            __m256i i = _mm256_cvtps_epi32(x);
+            __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+            
+            __m256 p = _mm256_set1_ps(c[3]);
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[2]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[1]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(c[0]));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+            
+            __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23));
+            return _mm256_mul_ps(p, scale);
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 fastPow_ps(__m256 x, __m256 y)
+        {
+            return fastExp2_ps(_mm256_mul_ps(y, fastLog2_ps(x)));
+        }
+        
+        ARCB_TARGET_AVX2 static inline __m256 cbrt_ps(__m256 x)
+        {
+            __m256 y = fastPow_ps(x, _mm256_set1_ps(1.0f / 3.0f));
+            __m256 y2 = _mm256_mul_ps(y, y);
+            return _mm256_fmadd_ps(_mm256_sub_ps(_mm256_div_ps(x, y2), y), _mm256_set1_ps(1.0f / 3.0f), y);
+        }
+    }
+
+#endif // ARCB_SIMD_X86
+
+};
+
+#endif /* simd_h */
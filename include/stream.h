@@ -0,0 +1,481 @@
+//
+//  stream.h
+//  ar-color-balancing
+//
+//  Streaming color correction of a video source with a persistent model, refit on
+//  significant correspondence changes and smoothed over time.
+//
+
+#ifndef stream_h
+#define stream_h
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <balance.h>
+#include <asyncfit.h>
+#include <pipeline.h>
+#include <profile.h>
+#include <opencv2/opencv.hpp>
+
+namespace stream
+{
+    // Running latency statistics of one pipeline stage, in seconds
+    struct StageStats
+    {
+        long count;
+        double total;
+        double max;
+
+        StageStats() : count(0), total(0.0), max(0.0) { }
+
+        void add(double seconds)
+        {
+            ++count;
+            total += seconds;
+            max = std::max(max, seconds);
+        }
+
+        double mean() const { return count > 0 ? total / count : 0.0; }
+    };
+
+    struct StreamStats
+    {
+        long frames;
+        long refits;
+        double wall_seconds;
+
+        StageStats capture;
+        StageStats samples;
+        StageStats fit;
+        StageStats correct;
+        StageStats output;
+        StageStats frame;       // samples, fit and correction: the frame thread's latency
+
+        // Pipelined runs only: the capture -> correct and correct -> output queues, and
+        // the free lists of the input and output frame pools. Push stalls on the output
+        // queue mean the sink is the bottleneck, pop stalls on the capture queue the source.
+        bool pipelined;
+        pipeline::QueueStats captured_queue;
+        pipeline::QueueStats corrected_queue;
+        pipeline::QueueStats input_pool;
+        pipeline::QueueStats output_pool;
+
+        StreamStats() : frames(0), refits(0), wall_seconds(0.0), pipelined(false) { }
+
+        // Sustained rate over the whole run, all stages included
+        double fps() const { return wall_seconds > 0.0 ? frames / wall_seconds : 0.0; }
+
+        void print(FILE* f) const
+        {
+            fprintf(f, "%ld frames in %.3f s, %.2f fps, %ld refits\n", frames, wall_seconds, fps(), refits);
+            fprintf(f, "%-8s %8s %10s %10s\n", "stage", "count", "mean ms", "max ms");
+
+            const char* names[] = { "capture", "samples", "fit", "correct", "output", "frame" };
+            const StageStats* stages[] = { &capture, &samples, &fit, &correct, &output, &frame };
+
+            for(int i = 0; i < 6; ++i)
+                fprintf(f, "%-8s %8ld %10.3f %10.3f\n", names[i], stages[i]->count, stages[i]->mean() * 1000.0, stages[i]->max * 1000.0);
+
+            if(!pipelined)
+                return;
+
+            fprintf(f, "%-10s %8s %10s %10s %12s %12s\n", "queue", "pushes", "mean depth", "max depth", "push stalls", "pop stalls");
+
+            const char* queue_names[] = { "captured", "corrected", "input", "output" };
+            const pipeline::QueueStats* queues[] = { &captured_queue, &corrected_queue, &input_pool, &output_pool };
+
+            for(int i = 0; i < 4; ++i)
+                fprintf(f, "%-10s %8ld %10.2f %10d %12ld %12ld\n", queue_names[i], queues[i]->pushes, queues[i]->meanDepth(),
+                        queues[i]->max_depth, queues[i]->push_stalls, queues[i]->pop_stalls);
+        }
+    };
+
+    struct StreamOptions
+    {
+        balance::CorrectionMode mode;
+        int lut_size;
+        int num_threads;            // 0 uses the shared default pool, or a full pool of its own with async_fit
+
+        // Mean absolute change, in 8 bit levels over all the correspondence bytes, above
+        // which the model is refit. A different number of samples always refits.
+        float refit_threshold;
+
+        // Fraction of the previous correction kept at each frame after a refit, in [0, 1).
+        // 0 switches to the new model at once. Only applies to the lut modes.
+        float smoothing;
+
+        // Capture, correction and output overlap on three threads, with queue_depth frames
+        // at most waiting between two stages
+        bool pipelined;
+        int queue_depth;
+
+        // Fits on a background thread: frames keep the current model until the new one is
+        // published, so a refit never adds to a frame's latency
+        bool async_fit;
+
+        StreamOptions() : mode(balance::MODE_LUT), lut_size(balance::DEFAULT_LUT_SIZE), num_threads(0),
+                          refit_threshold(1.0f), smoothing(0.0f), pipelined(false), queue_depth(4), async_fit(false) { }
+    };
+
+    // Reads frames from a cv::VideoCapture source (file, image sequence pattern or camera),
+    // corrects each one with a persistent balance::Model and hands the result to a sink.
+    //
+    // Correspondences come from a SampleSource called once per frame; it returns false
+    // when it has nothing new, and the current model is kept. New correspondences that
+    // differ from the fitted ones by less than refit_threshold are ignored as well.
+    //
+    // With async_fit, refits go to a balance::AsyncFitter and a model is adopted on the
+    // first frame after it is published; the fit stage then records the background fit
+    // times. Only the first fit is waited for, as there is no model to apply before it.
+    // Correction runs on a pool of its own, so a background fit never takes its workers.
+    //
+    // With smoothing, a refit model becomes the target and the applied model moves toward
+    // it by exponential smoothing on each frame, so a refit never shows as a jump.
+    //
+    // Output is double buffered: frame i is written to one of two buffers, so the image
+    // handed to the sink for frame i - 1 stays valid until the sink for frame i returns.
+    //
+    // Pipelined, capture runs on its own thread, correction on the calling thread and the
+    // sink on a third one. Frames move by index through bounded SPSC queues and come from
+    // two recycled pools, so a slow sink blocks correction, then capture, instead of
+    // buffering. The sink's image is only valid until it returns, and the sample source
+    // is called on the calling thread.
+
+    class StreamEngine
+    {
+    public:
+        // fills rgb_pairs with num_samples correspondences for the frame, or returns false
+        typedef std::function<bool(int frame_index, const cv::Mat& frame,
+                                   std::vector<unsigned char>& rgb_pairs, int& num_samples)> SampleSource;
+
+        // consumes a corrected frame, returns false to stop the stream
+        typedef std::function<bool(int frame_index, const cv::Mat& corrected)> FrameSink;
+
+        explicit StreamEngine(const StreamOptions& in_options = StreamOptions()) : options(in_options),
+                                                                                 pool(in_options.num_threads > 0 ? in_options.num_threads : (in_options.async_fit ? 0 : 1)),
+                                                                                 fitted_generation(0), num_samples(0), fitted_samples(0)
+        {
+            if(options.async_fit)
+                fitter.reset(new balance::AsyncFitter(options.mode, options.lut_size));
+        }
+
+        bool open(const std::string& source)
+        {
+            return capture.open(source) && capture.isOpened();
+        }
+
+        // Runs until the source or the sink ends, or after max_frames frames (< 0: no limit)
+        bool run(const SampleSource& sample_source, const FrameSink& sink, long max_frames = -1)
+        {
+            if(!capture.isOpened())
+                return false;
+
+            const clock::time_point begin = clock::now();
+
+            if(options.pipelined)
+                runPipelined(sample_source, sink, max_frames);
+            else
+                runSerial(sample_source, sink, max_frames);
+
+            stats.wall_seconds = seconds(begin, clock::now());
+            return true;
+        }
+
+        const StreamStats& streamStats() const { return stats; }
+        const balance::Model* model() const { return applied.get(); }
+        double framesPerSecond() const { return capture.get(cv::CAP_PROP_FPS); }
+
+    private:
+        StreamEngine(const StreamEngine& other);
+        StreamEngine& operator=(const StreamEngine& other);
+
+        typedef std::chrono::steady_clock clock;
+
+        // frame index and pool buffer handed between the pipeline stages, -1 ends the stream
+        struct Item
+        {
+            int frame;
+            int buffer;
+        };
+
+        bool readFrame(cv::Mat& frame)
+        {
+            PROFILE_SCOPE(TIMER_READ);
+            return capture.read(frame) && !frame.empty();
+        }
+
+        bool writeFrame(const FrameSink& sink, int frame_index, const cv::Mat& corrected)
+        {
+            PROFILE_SCOPE(TIMER_WRITE);
+            PROFILE_COUNT(COUNTER_FRAMES, 1);
+            return !sink || sink(frame_index, corrected);
+        }
+
+        void runSerial(const SampleSource& sample_source, const FrameSink& sink, long max_frames)
+        {
+            cv::Mat frame;
+
+            for(long f = 0; max_frames < 0 || f < max_frames; ++f)
+            {
+                clock::time_point t0 = clock::now();
+
+                if(!readFrame(frame))
+                    break;
+
+                clock::time_point t1 = clock::now();
+                stats.capture.add(seconds(t0, t1));
+
+                update((int)f, frame, sample_source);
+
+                clock::time_point t2 = clock::now();
+
+                cv::Mat& out = buffers[f & 1];
+                correctFrame(frame, out);
+
+                clock::time_point t3 = clock::now();
+                stats.correct.add(seconds(t2, t3));
+                stats.frame.add(seconds(t1, t3));
+
+                const bool more = writeFrame(sink, (int)f, out);
+
+                stats.output.add(seconds(t3, clock::now()));
+                ++stats.frames;
+
+                if(!more)
+                    break;
+            }
+        }
+
+        void runPipelined(const SampleSource& sample_source, const FrameSink& sink, long max_frames)
+        {
+            const int depth = std::max(1, options.queue_depth);
+
+            // one buffer in each queue slot, plus the one held by each adjacent stage
+            pipeline::FramePool inputs(depth + 2);
+            pipeline::FramePool outputs(depth + 2);
+            pipeline::SpscQueue<Item> captured(depth);
+            pipeline::SpscQueue<Item> corrected(depth);
+
+            std::atomic<bool> stop(false);
+            const Item end = { -1, -1 };
+
+            std::thread capture_thread([&]()
+            {
+                for(long f = 0; (max_frames < 0 || f < max_frames) && !stop.load(std::memory_order_relaxed); ++f)
+                {
+                    const int b = inputs.acquire();
+                    clock::time_point t0 = clock::now();
+
+                    // the unread buffer is not released: only the correction thread pushes to the free list
+                    if(!readFrame(inputs[b]))
+                        break;
+
+                    stats.capture.add(seconds(t0, clock::now()));
+
+                    const Item item = { (int)f, b };
+                    captured.push(item);
+                }
+
+                captured.push(end);
+            });
+
+            // after a stop the output thread keeps draining, so upstream stages never block
+            std::thread output_thread([&]()
+            {
+                Item item;
+
+                for(corrected.pop(item); item.buffer >= 0; corrected.pop(item))
+                {
+                    if(!stop.load(std::memory_order_relaxed))
+                    {
+                        clock::time_point t0 = clock::now();
+
+                        const bool more = writeFrame(sink, item.frame, outputs[item.buffer]);
+
+                        stats.output.add(seconds(t0, clock::now()));
+                        ++stats.frames;
+
+                        if(!more)
+                            stop.store(true, std::memory_order_relaxed);
+                    }
+
+                    outputs.release(item.buffer);
+                }
+            });
+
+            Item item;
+
+            for(captured.pop(item); item.buffer >= 0; captured.pop(item))
+            {
+                cv::Mat& frame = inputs[item.buffer];
+                clock::time_point t0 = clock::now();
+
+                update(item.frame, frame, sample_source);
+
+                // waiting for an output buffer is back-pressure, not latency of this stage
+                clock::time_point t1 = clock::now();
+                const int o = outputs.acquire();
+                clock::time_point t2 = clock::now();
+
+                correctFrame(frame, outputs[o]);
+
+                clock::time_point t3 = clock::now();
+                stats.correct.add(seconds(t2, t3));
+                stats.frame.add(seconds(t0, t1) + seconds(t2, t3));
+                inputs.release(item.buffer);
+
+                const Item out = { item.frame, o };
+                corrected.push(out);
+            }
+
+            corrected.push(end);
+
+            capture_thread.join();
+            output_thread.join();
+
+            stats.pipelined = true;
+            stats.captured_queue = captured.stats();
+            stats.corrected_queue = corrected.stats();
+            stats.input_pool = inputs.stats();
+            stats.output_pool = outputs.stats();
+        }
+
+        // Takes the frame's correspondences, refits and smooths
+        void update(int frame_index, const cv::Mat& frame, const SampleSource& sample_source)
+        {
+            clock::time_point t0 = clock::now();
+
+            if(sample_source && sample_source(frame_index, frame, rgb_pairs, num_samples))
+            {
+                clock::time_point t1 = clock::now();
+                stats.samples.add(seconds(t0, t1));
+
+                if(num_samples > 0 && needsRefit(rgb_pairs, num_samples))
+                {
+                    refit(rgb_pairs, num_samples);
+
+                    if(!fitter)
+                        stats.fit.add(seconds(t1, clock::now()));
+                }
+            }
+
+            // nothing to show before the first model: only this wait is ever on the frame path
+            if(fitter && !applied && fitted_samples > 0)
+                fitter->wait();
+
+            if(fitter && fitter->generation() != fitted_generation)
+            {
+                fitted_generation = fitter->generation();
+                adopt(fitter->current());
+                stats.fit.add(fitter->lastFitSeconds());
+            }
+
+            if(applied)
+                smooth();
+        }
+
+        static double seconds(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+        {
+            return std::chrono::duration<double>(b - a).count();
+        }
+
+        bool needsRefit(const std::vector<unsigned char>& rgb_pairs, int num_samples) const
+        {
+            if(!applied || num_samples != fitted_samples)
+                return true;
+
+            long change = 0;
+            const int bytes = num_samples * 6;
+
+            for(int i = 0; i < bytes; ++i)
+                change += std::abs((int)rgb_pairs[i] - (int)fitted_pairs[i]);
+
+            return (float)change / bytes > options.refit_threshold;
+        }
+
+        void refit(const std::vector<unsigned char>& rgb_pairs, int num_samples)
+        {
+            fitted_pairs.assign(rgb_pairs.begin(), rgb_pairs.begin() + num_samples * 6);
+            fitted_samples = num_samples;
+
+            if(fitter)
+                fitter->submit(&rgb_pairs[0], num_samples);
+            else
+                adopt(std::make_shared<balance::Model>(&rgb_pairs[0], num_samples, options.mode, options.lut_size));
+        }
+
+        // Makes a newly fitted model the target, or the applied model when not smoothing
+        void adopt(const std::shared_ptr<balance::Model>& next)
+        {
+            ++stats.refits;
+
+            const bool lut_mode = balance::MODE_LUT == options.mode || balance::MODE_LUT8 == options.mode;
+
+            if(applied && options.smoothing > 0.0f && lut_mode)
+                target = next;
+            else
+            {
+                applied = next;
+                target.reset();
+            }
+        }
+
+        // One smoothing step toward the target model; adopts it once close enough
+        void smooth()
+        {
+            if(!target)
+                return;
+
+            // Lab units below which the last step snaps to the target
+            const float done = 0.05f;
+            const float remaining = applied->blendToward(*target, options.smoothing);
+
+            if(remaining < done)
+                applied = std::move(target);
+        }
+
+        // Frames before the first model pass through uncorrected rather than being dropped
+        void correctFrame(const cv::Mat& frame, cv::Mat& out)
+        {
+            if(!applied)
+                frame.copyTo(out);
+            else if(options.num_threads > 0 || fitter)
+                balance::applyColorBalance(frame, out, *applied, pool, scratch);
+            else
+                balance::applyColorBalance(frame, out, *applied, parallel::defaultPool(), scratch);
+        }
+
+        StreamOptions options;
+        parallel::ThreadPool pool;
+        cv::VideoCapture capture;
+
+        // row buffers of the correction workers, only used by the correction stage
+        std::vector<balance::RowScratch> scratch;
+
+        // shared with the fitter in async mode, which drops a model once it publishes the next
+        std::shared_ptr<balance::Model> applied;
+        std::shared_ptr<balance::Model> target;
+        std::unique_ptr<balance::AsyncFitter> fitter;
+        unsigned long fitted_generation;
+
+        std::vector<unsigned char> rgb_pairs;
+        int num_samples;
+
+        std::vector<unsigned char> fitted_pairs;
+        int fitted_samples;
+
+        cv::Mat buffers[2];
+
+        StreamStats stats;
+    };
+
+}
+
+#endif /* stream_h */
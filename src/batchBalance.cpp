@@ -0,0 +1,325 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <balance.h>
+#include <modelfile.h>
+#include <datahelpers.h>
+#include <opencv2/opencv.hpp>
+
+// Color balances a batch of images without a display. The model is fitted once (or loaded
+// from a model file), then a pool of workers takes the images one at a time, each reading,
+// correcting and writing its own, so reads and writes of some images overlap the correction
+// of others. The images are a directory, a wildcard pattern (e.g. shots/*.png) or @list, a
+// text file with one path per line. The outputs keep the input file names, which must
+// therefore be unique.
+
+struct FileResult
+{
+    bool ok;
+    int width;
+    int height;
+    double read_ms;
+    double correct_ms;
+    double write_ms;
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+}
+
+static bool isImageFile(const std::string& path)
+{
+    const char* extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff", ".ppm", ".webp" };
+
+    std::string lower = path;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+    for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+    {
+        const size_t n = strlen(extensions[i]);
+
+        if(lower.size() > n && 0 == lower.compare(lower.size() - n, n, extensions[i]))
+            return true;
+    }
+
+    return false;
+}
+
+static bool listImages(const char* images, std::vector<std::string>& files)
+{
+    if('@' == images[0])
+    {
+        data::TextScanner scanner(images + 1);
+
+        if(!scanner.isOpen())
+        {
+            printf("Error reading file.\n");
+            return false;
+        }
+
+        const char* first;
+        const char* last;
+
+        while(scanner.nextLine(first, last))
+        {
+            // paths may hold spaces, only surrounding white space is dropped
+            while(first < last && isspace((unsigned char)*first))
+                ++first;
+
+            while(last > first && isspace((unsigned char)last[-1]))
+                --last;
+
+            if(first < last)
+                files.push_back(std::string(first, last));
+        }
+
+        return true;
+    }
+
+    std::vector<cv::String> found;
+    cv::glob(images, found, false);
+
+    for(size_t i = 0; i < found.size(); ++i)
+        if(isImageFile(found[i]))
+            files.push_back(found[i]);
+
+    return true;
+}
+
+static std::string outputPath(const std::string& output_dir, const std::string& input)
+{
+    const size_t slash = input.find_last_of("/\\");
+    return output_dir + "/" + (std::string::npos == slash ? input : input.substr(slash + 1));
+}
+
+// Absolute path with . and .. resolved (and links, except on Windows), to compare paths
+// spelled differently. A file that does not exist yet, like an output, is resolved through
+// its directory; the path is kept as is if that does not exist either.
+static std::string canonicalPath(const std::string& path)
+{
+    std::string resolved = path;
+
+#if defined(_WIN32)
+    if (char* full = _fullpath(nullptr, path.c_str(), 0))
+    {
+        resolved = full;
+        free(full);
+    }
+
+    // NTFS names are case insensitive
+    std::transform(resolved.begin(), resolved.end(), resolved.begin(), ::tolower);
+#else
+    if (char* full = realpath(path.c_str(), nullptr))
+    {
+        resolved = full;
+        free(full);
+    }
+    else
+    {
+        const size_t slash = path.find_last_of('/');
+        const std::string dir = std::string::npos == slash ? "." : path.substr(0, std::max((size_t)1, slash));
+
+        if (char* full = realpath(dir.c_str(), nullptr))
+        {
+            resolved = std::string(full) + ('/' == full[strlen(full) - 1] ? "" : "/") +
+                       (std::string::npos == slash ? path : path.substr(slash + 1));
+            free(full);
+        }
+    }
+#endif
+
+    return resolved;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 4)
+    {
+        printf("Please enter the color samples or model file, the images (directory, pattern or @list file) and the output directory. "
+               "Optionally, the mode (lut, lut8, exact or rbf), the lut grid size and the number of workers.\n");
+        return -1;
+    }
+
+    const char* color_samples_file = argv[1];
+    const std::string output_dir = argv[3];
+    int num_workers = argc > 6 ? atoi(argv[6]) : 0;
+
+    if (num_workers <= 0)
+        num_workers = parallel::defaultNumThreads();
+
+    std::vector<std::string> files;
+
+    if (!listImages(argv[2], files))
+        return -1;
+
+    if (files.empty())
+    {
+        printf("No images found in %s.\n", argv[2]);
+        return -1;
+    }
+
+    // outputs keep only the file names: reject any two landing on the same path, and any
+    // output overwriting an input, before the workers start
+    std::map<std::string, size_t> inputs, outputs;
+
+    for(size_t i = 0; i < files.size(); ++i)
+        inputs.insert(std::make_pair(canonicalPath(files[i]), i));
+
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        const std::string output = canonicalPath(outputPath(output_dir, files[i]));
+        std::map<std::string, size_t>::const_iterator input = inputs.find(output);
+
+        if (input != inputs.end())
+        {
+            printf("The output directory must differ from the input ones, %s would be overwritten.\n", files[input->second].c_str());
+            return -1;
+        }
+
+        std::pair<std::map<std::string, size_t>::iterator, bool> added = outputs.insert(std::make_pair(output, i));
+
+        if (!added.second)
+        {
+            printf("%s and %s would both be written to %s.\n", files[added.first->second].c_str(), files[i].c_str(), output.c_str());
+            return -1;
+        }
+    }
+
+    num_workers = std::min(num_workers, (int)files.size());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::shared_ptr<balance::Model> model;
+
+    if (balance::isModelFile(color_samples_file))
+    {
+        model = balance::loadModel(color_samples_file);
+
+        if (!model)
+            return -1;
+    }
+    else
+    {
+        std::vector<unsigned char> rgb;
+        int num_samples = 0;
+
+        if (!data::readColorSamples(color_samples_file, rgb, num_samples))
+            return -1;
+
+        balance::CorrectionMode mode = balance::MODE_LUT;
+
+        if (argc > 4 && !balance::parseCorrectionMode(argv[4], mode))
+        {
+            printf("Unknown mode %s.\n", argv[4]);
+            return -1;
+        }
+
+        int lut_size = argc > 5 ? atoi(argv[5]) : balance::DEFAULT_LUT_SIZE;
+
+        if (!balance::validLutSize(mode, lut_size))
+        {
+            printf("Invalid lut size.\n");
+            return -1;
+        }
+
+        model = std::make_shared<balance::Model>(&rgb[0], num_samples, mode, lut_size);
+    }
+
+    printf("Model ready in %.2f ms, %d images on %d workers\n", elapsedMs(start), (int)files.size(), num_workers);
+
+    // each worker corrects inline on its own single thread pool: the parallelism is across files
+    std::vector<FileResult> results(files.size());
+    std::atomic<int> next_file(0);
+
+    start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+
+    for(int w = 0; w < num_workers; ++w)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            parallel::ThreadPool pool(1);
+            std::vector<balance::RowScratch> scratch;
+            cv::Mat img;
+            int i;
+
+            while((i = next_file.fetch_add(1)) < (int)files.size())
+            {
+                FileResult& r = results[i];
+                r = FileResult();
+
+                std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+                img = cv::imread(files[i], cv::IMREAD_COLOR);
+                r.read_ms = elapsedMs(t);
+
+                if (!img.data)
+                    continue;
+
+                r.width = img.cols;
+                r.height = img.rows;
+
+                t = std::chrono::steady_clock::now();
+                balance::applyColorBalance(img, img, *model, pool, scratch);
+                r.correct_ms = elapsedMs(t);
+
+                t = std::chrono::steady_clock::now();
+                r.ok = cv::imwrite(outputPath(output_dir, files[i]), img);
+                r.write_ms = elapsedMs(t);
+            }
+        }));
+    }
+
+    for(size_t w = 0; w < workers.size(); ++w)
+        workers[w].join();
+
+    const double wall_seconds = elapsedMs(start) / 1000.0;
+
+    printf("%-40s %12s %10s %10s %10s\n", "file", "size", "read ms", "correct ms", "write ms");
+
+    int done = 0;
+    double pixels = 0.0, read_ms = 0.0, correct_ms = 0.0, write_ms = 0.0;
+
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        const FileResult& r = results[i];
+
+        if (!r.width)
+        {
+            printf("%-40s could not be read\n", files[i].c_str());
+            continue;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+        printf("%-40s %12s %10.2f %10.2f %10.2f%s\n", files[i].c_str(), size, r.read_ms, r.correct_ms, r.write_ms,
+               r.ok ? "" : "  could not be written");
+
+        if (!r.ok)
+            continue;
+
+        ++done;
+        pixels += (double)r.width * r.height;
+        read_ms += r.read_ms;
+        correct_ms += r.correct_ms;
+        write_ms += r.write_ms;
+    }
+
+    printf("%d of %d images in %.3f s: %.2f images/s, %.1f Mpx/s\n", done, (int)files.size(), wall_seconds,
+           done / wall_seconds, pixels * 1e-6 / wall_seconds);
+
+    if (done)
+        printf("mean per image: read %.2f ms, correct %.2f ms, write %.2f ms\n", read_ms / done, correct_ms / done, write_ms / done);
+
+    if (profile::enabled())
+        profile::printText(stdout);
+
+    return done == (int)files.size() ? 0 : -1;
+}
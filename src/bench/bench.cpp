@@ -0,0 +1,270 @@
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+#include <benchmark.h>
+#include <balance.h>
+#include <opencv2/opencv.hpp>
+
+#define CONVERSION_PIXELS (1 << 20)
+#define EVAL_POINTS (1 << 16)
+#define CORRECTION_SAMPLES 64
+
+// Benchmarks of color conversion, RBF fit and evaluation, and full frame correction on
+// synthetic inputs. Options: --filter=substring, --min_time=seconds, --threads=n (frame
+// correction, 0 for all cores) and --json=file to write the results as JSON ("-": stdout,
+// the table then goes to stderr).
+
+static std::string name(const char* prefix, int n)
+{
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s/%d", prefix, n);
+    return buffer;
+}
+
+// Random Lab points and offsets, drawn as randomPoints does with Eigen's Random
+static void randomLab(int n, Eigen::Matrix<float, Eigen::Dynamic, 3>& pts, Eigen::Matrix<float, Eigen::Dynamic, 3>& vals)
+{
+    srand(1);
+
+    pts = Eigen::Matrix<float, Eigen::Dynamic, 3>::Random(n, 3);
+    vals = Eigen::Matrix<float, Eigen::Dynamic, 3>::Random(n, 3) * 10.0f;
+
+    pts.col(0) = (pts.col(0).array() + 1.0f) * 50.0f;
+    pts.col(1) *= 100.0f;
+    pts.col(2) *= 100.0f;
+}
+
+// Random source colors with targets a few levels away, as compareSolvers generates them
+static void randomSamples(int n, std::vector<unsigned char>& rgb)
+{
+    srand(1);
+    rgb.resize(n * 6);
+
+    for(int i = 0; i < n * 3; ++i)
+    {
+        int src = rand() % 256;
+        rgb[(i / 3) * 6 + i % 3] = (unsigned char)src;
+        rgb[(i / 3) * 6 + 3 + i % 3] = (unsigned char)std::min(255, std::max(0, src + rand() % 41 - 20));
+    }
+}
+
+// Smooth gradients with a little noise, a stand in for camera frames
+static cv::Mat syntheticFrame(int width, int height)
+{
+    cv::Mat frame(height, width, CV_8UC3);
+    srand(1);
+
+    for(int y = 0; y < height; ++y)
+    {
+        unsigned char* row = frame.ptr<unsigned char>(y);
+
+        for(int x = 0; x < width; ++x)
+        {
+            row[x * 3 + 0] = (unsigned char)(x * 255 / width);
+            row[x * 3 + 1] = (unsigned char)(y * 255 / height);
+            row[x * 3 + 2] = (unsigned char)std::min(255, ((x + y) * 255 / (width + height)) + rand() % 8);
+        }
+    }
+
+    return frame;
+}
+
+static void benchConversions(bench::Runner& runner)
+{
+    const int n = CONVERSION_PIXELS;
+
+    std::vector<float> frgb(n * 3), flab(n * 3);
+    std::vector<unsigned char> rgb8(n * 3), lab8(n * 3);
+
+    srand(1);
+
+    for(int i = 0; i < n * 3; ++i)
+    {
+        rgb8[i] = (unsigned char)(rand() % 256);
+        frgb[i] = rgb8[i] / 255.0f;
+    }
+
+    color::RGB2Lab<float> toLab(3, 2, nullptr, nullptr, true);
+    color::Lab2RGB<float> toRGB(3, 2, nullptr, nullptr, true);
+    color::RGB2Lab<unsigned char> toLab8(3, 2, nullptr, nullptr, true);
+    color::Lab2RGB<unsigned char> toRGB8(3, 2, nullptr, nullptr, true);
+
+    toLab.convert(&frgb[0], &flab[0], n);
+    toLab8.convert(&rgb8[0], &lab8[0], n);
+
+    runner.run("color/RGB2Lab<float>", n, "px", [&]() { toLab.convert(&frgb[0], &flab[0], n); bench::doNotOptimize(flab[0]); });
+    runner.run("color/Lab2RGB<float>", n, "px", [&]() { toRGB.convert(&flab[0], &frgb[0], n); bench::doNotOptimize(frgb[0]); });
+    runner.run("color/RGB2Lab<uchar>", n, "px", [&]() { toLab8.convert(&rgb8[0], &lab8[0], n); bench::doNotOptimize(lab8[0]); });
+    runner.run("color/Lab2RGB<uchar>", n, "px", [&]() { toRGB8.convert(&lab8[0], &rgb8[0], n); bench::doNotOptimize(rgb8[0]); });
+}
+
+static void benchRBF(bench::Runner& runner)
+{
+    Eigen::Matrix<float, Eigen::Dynamic, 3> pts, vals;
+
+    for(int n = 16; n <= 4096; n *= 2)
+    {
+        const std::string bench_name = name("rbf/fit", n);
+
+        if(!runner.enabled(bench_name))
+            continue;
+
+        randomLab(n, pts, vals);
+
+        runner.run(bench_name, n, "samples", [&]()
+        {
+            balance::Interpolator interp(pts, vals, true);
+            bench::doNotOptimize(interp.fitReport().relative_residual);
+        });
+    }
+
+    std::vector<float> planes(EVAL_POINTS * 6);
+    srand(2);
+
+    for(int i = 0; i < EVAL_POINTS; ++i)
+    {
+        planes[i] = 100.0f * rand() / RAND_MAX;
+        planes[EVAL_POINTS + i] = 200.0f * rand() / RAND_MAX - 100.0f;
+        planes[2 * EVAL_POINTS + i] = 200.0f * rand() / RAND_MAX - 100.0f;
+    }
+
+    const float* in[] = { &planes[0], &planes[EVAL_POINTS], &planes[2 * EVAL_POINTS] };
+    float* out[] = { &planes[3 * EVAL_POINTS], &planes[4 * EVAL_POINTS], &planes[5 * EVAL_POINTS] };
+
+    for(int n = 16; n <= 4096; n *= 4)
+    {
+        const std::string bench_name = name("rbf/interpolate", n);
+
+        if(!runner.enabled(bench_name))
+            continue;
+
+        randomLab(n, pts, vals);
+        balance::Interpolator interp(pts, vals, true);
+
+        runner.run(bench_name, EVAL_POINTS, "points", [&]()
+        {
+            interp.interpolate(in, out, EVAL_POINTS);
+            bench::doNotOptimize(out[0][0]);
+        });
+    }
+}
+
+static void benchCorrection(bench::Runner& runner, int num_threads)
+{
+    const struct { const char* name; int width; int height; } resolutions[] =
+    {
+        { "720p", 1280, 720 },
+        { "1080p", 1920, 1080 },
+        { "4K", 3840, 2160 },
+    };
+
+    const struct { const char* name; balance::CorrectionMode mode; } modes[] =
+    {
+        { "lut", balance::MODE_LUT },
+        { "lut8", balance::MODE_LUT8 },
+        { "exact", balance::MODE_EXACT },
+        { "rbf", balance::MODE_RBF },
+    };
+
+    std::vector<unsigned char> rgb;
+    randomSamples(CORRECTION_SAMPLES, rgb);
+
+    parallel::ThreadPool pool(num_threads);
+
+    for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+    {
+        std::unique_ptr<balance::Model> model;
+
+        for(size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); ++r)
+        {
+            const std::string bench_name = std::string("correct/") + modes[m].name + "/" + resolutions[r].name;
+
+            if(!runner.enabled(bench_name))
+                continue;
+
+            if(!model)
+                model.reset(new balance::Model(&rgb[0], CORRECTION_SAMPLES, modes[m].mode));
+
+            cv::Mat src = syntheticFrame(resolutions[r].width, resolutions[r].height), dst;
+
+            runner.run(bench_name, (double)src.rows * src.cols, "px", [&]()
+            {
+                balance::applyColorBalance(src, dst, *model, pool);
+                bench::doNotOptimize(dst.data[0]);
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bench::Runner runner;
+    const char* json = nullptr;
+    int num_threads = 0;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if (0 == strncmp(argv[i], "--filter=", 9))
+            runner.filter = argv[i] + 9;
+        else if (0 == strncmp(argv[i], "--min_time=", 11))
+            runner.min_time = atof(argv[i] + 11);
+        else if (0 == strncmp(argv[i], "--threads=", 10))
+            num_threads = atoi(argv[i] + 10);
+        else if (0 == strncmp(argv[i], "--json=", 7))
+            json = argv[i] + 7;
+        else
+        {
+            printf("Unknown option %s. Options: --filter=substring --min_time=seconds --threads=n --json=file\n", argv[i]);
+            return -1;
+        }
+    }
+
+    const char* levels[] = { "scalar", "sse2", "avx2" };
+    const int threads = num_threads > 0 ? num_threads : parallel::defaultNumThreads();
+
+    FILE* f = nullptr;
+
+    if (json)
+    {
+        f = 0 == strcmp(json, "-") ? stdout : fopen(json, "w");
+
+        if (f == NULL)
+        {
+            printf("Error creating file!\n");
+            return -1;
+        }
+    }
+
+    // with the JSON on stdout, the table goes to stderr so that stdout parses as is
+    if (f == stdout)
+        runner.out = stderr;
+
+    fprintf(runner.out, "simd %s, %d correction threads\n", levels[simd::level()], threads);
+    bench::Runner::printHeader(runner.out);
+
+    benchConversions(runner);
+    benchRBF(runner);
+    benchCorrection(runner, num_threads);
+
+    if (f)
+    {
+        std::vector<std::pair<std::string, std::string> > context;
+        context.push_back(std::make_pair(std::string("simd"), std::string(levels[simd::level()])));
+        context.push_back(std::make_pair(std::string("correction_threads"), name("", threads).substr(1)));
+        context.push_back(std::make_pair(std::string("hardware_threads"), name("", parallel::defaultNumThreads()).substr(1)));
+#ifdef NDEBUG
+        context.push_back(std::make_pair(std::string("build"), std::string("release")));
+#else
+        context.push_back(std::make_pair(std::string("build"), std::string("debug")));
+#endif
+
+        runner.writeJSON(f, context);
+
+        if (f != stdout)
+            fclose(f);
+    }
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <colorbalancer.h>
+#include <balance.h>
+#include <modelfile.h>
+#include <cmath>
+
+namespace balance
+{
+    struct ColorBalancer::Impl
+    {
+        Options options;
+        std::shared_ptr<Model> model;
+        std::unique_ptr<parallel::ThreadPool> pool;     // null for the shared default pool
+        std::vector<RowScratch> scratch;
+
+        parallel::ThreadPool& workers() { return pool ? *pool : parallel::defaultPool(); }
+    };
+
+    static CorrectionMode correctionMode(ColorBalancer::Mode mode)
+    {
+        const CorrectionMode modes[] = { MODE_LUT, MODE_EXACT, MODE_RBF, MODE_LUT8 };
+        return modes[mode];
+    }
+
+    ColorBalancer::ColorBalancer() : impl(new Impl())
+    {
+    }
+
+    ColorBalancer::ColorBalancer(const Options& options) : impl(new Impl())
+    {
+        impl->options = options;
+
+        if(options.num_threads > 0)
+            impl->pool.reset(new parallel::ThreadPool(options.num_threads));
+    }
+
+    ColorBalancer::~ColorBalancer()
+    {
+    }
+
+    bool ColorBalancer::fit(const unsigned char* rgb_pairs, int num_samples)
+    {
+        const Options& o = impl->options;
+
+        if(!rgb_pairs || num_samples < 1)
+        {
+            printf("No color samples to fit.\n");
+            return false;
+        }
+
+        if(!validLutSize(correctionMode(o.mode), o.lut_size))
+        {
+            printf("Invalid lut size.\n");
+            return false;
+        }
+
+        // 0 selects the dense model, anything else must be a usable grid cell size
+        if(!std::isfinite(o.support_radius) || o.support_radius < 0.0f)
+        {
+            printf("Invalid support radius.\n");
+            return false;
+        }
+
+        impl->model = std::make_shared<Model>(rgb_pairs, num_samples, correctionMode(o.mode), o.lut_size,
+                                              rbf::SOLVER_LDLT, o.support_radius);
+        return true;
+    }
+
+    bool ColorBalancer::fit(const std::vector<unsigned char>& rgb_pairs)
+    {
+        return fit(rgb_pairs.empty() ? nullptr : &rgb_pairs[0], (int)rgb_pairs.size() / 6);
+    }
+
+    bool ColorBalancer::load(const char* filename)
+    {
+        std::shared_ptr<Model> loaded = loadModel(filename);
+
+        if(!loaded)
+            return false;
+
+        setModel(loaded);
+        return true;
+    }
+
+    bool ColorBalancer::save(const char* filename) const
+    {
+        if(!impl->model)
+        {
+            printf("No model to save.\n");
+            return false;
+        }
+
+        return saveModel(*impl->model, filename);
+    }
+
+    bool ColorBalancer::fitted() const
+    {
+        return (bool)impl->model;
+    }
+
+    bool ColorBalancer::apply(const cv::Mat& src, cv::Mat& dst)
+    {
+        if(!impl->model || src.type() != CV_8UC3)
+            return false;
+
+        applyColorBalance(src, dst, *impl->model, impl->workers(), impl->scratch);
+        return true;
+    }
+
+    bool ColorBalancer::applyInPlace(cv::Mat& image)
+    {
+        return apply(image, image);
+    }
+
+    std::shared_ptr<Model> ColorBalancer::model() const
+    {
+        return impl->model;
+    }
+
+    void ColorBalancer::setModel(const std::shared_ptr<Model>& model)
+    {
+        impl->model = model;
+
+        if(!model)
+            return;
+
+        // options() reflects the model in use
+        const Mode modes[] = { LUT, EXACT, RBF, LUT8 };
+        impl->options.mode = modes[model->correctionMode()];
+
+        if(model->colorLUT())
+            impl->options.lut_size = model->colorLUT()->gridSize();
+        else if(model->colorLUT8())
+            impl->options.lut_size = model->colorLUT8()->gridSize();
+    }
+
+    const ColorBalancer::Options& ColorBalancer::options() const
+    {
+        return impl->options;
+    }
+
+}
@@ -1,16 +1,16 @@
 #include <iostream>
-#include <rbf.h>
-#include <colors.h>
+#include <cstring>
+#include <balance.h>
+#include <colorbalancer.h>
+#include <modelfile.h>
 #include <datahelpers.h>
 #include <opencv2/opencv.hpp>
 
 #define DATA_DIM 3
-#define R 0
-#define G 1
-#define B 2
 
 #define MAX_WIDTH_VIZ 1000.0f
 #define MAX_HEIGHT_VIZ 800.0f
+#define LUT_SIZE balance::DEFAULT_LUT_SIZE
 
 
 
@@ -19,104 +19,72 @@ int main(int argc, char** argv)
     
     if(argc < 3)
     {
-        printf("Please enter the color samples file.\n");
+        printf("Please enter the image and the color samples file. Optionally, the mode (lut, lut8, exact or rbf), the lut grid size, the number of threads, a Wendland support radius in Lab units (sparse fit) and a file to save the model to. A model file can replace the color samples file.\n");
         return -1;
     }
     
     const char* color_samples_file = argv[2];
     
-    FILE *f = fopen(color_samples_file, "r");
+    balance::ColorBalancer::Options options;
+    options.num_threads = argc > 5 ? atoi(argv[5]) : 0;
     
-    if (f == NULL)
-    {
-        printf("Error reading file.\n");
-        return false;
-    }
-    
-    int num_samples = 0;
-    int fres = fscanf(f,"%d\n",&num_samples);
-    
-    if (fres == EOF || num_samples == 0)
-    {
-        printf("File format error.\n");
-        return false;
-    }
-    
-    Eigen::Matrix<float, Eigen::Dynamic, DATA_DIM, Eigen::RowMajor> support
-        = Eigen::Matrix<float, Eigen::Dynamic, DATA_DIM, Eigen::RowMajor>::Zero(num_samples, DATA_DIM);
-    
-    Eigen::Matrix<float, Eigen::Dynamic, 1> values[3];
-    
-    values[R] = Eigen::Matrix<float, Eigen::Dynamic, 1>::Zero(num_samples);
-    values[G] = Eigen::Matrix<float, Eigen::Dynamic, 1>::Zero(num_samples);
-    values[B] = Eigen::Matrix<float, Eigen::Dynamic, 1>::Zero(num_samples);
-    
-    int v = 0;
-    unsigned char*   rgb    = (unsigned char*)malloc(sizeof(unsigned char) * num_samples * DATA_DIM * 2);
-    float*           frgb   = (float*)malloc(sizeof(float) * num_samples * DATA_DIM * 2);
-    float*           lab    = (float*)malloc(sizeof(float) * num_samples * DATA_DIM * 2);
+    // a saved model skips the fit, the mode and lut size are the saved ones
+    std::unique_ptr<balance::ColorBalancer> balancer;
     
-    color::IColorConversion<float>* rgbToLab = color::CreateColorConversion<float>(color::sRGB_to_CIELAB, color::RGB);
-    color::IColorConversion<float>* labToRgb = color::CreateColorConversion<float>(color::CIELAB_sRGB, color::RGB);
-    
-    for(int i = 0; i < num_samples; ++i)
+    if (balance::isModelFile(color_samples_file))
     {
-        for(int j = 0; j < 2 * DATA_DIM; ++j)
-        {
-            fscanf(f,"%d ",&v);
-            rgb[i * (2 * DATA_DIM) + j] = (unsigned char)v;
-        }
+        balancer.reset(new balance::ColorBalancer(options));
+        
+        if (!balancer->load(color_samples_file))
+            return -1;
     }
-    
-    color::RGB255_to_RGB01(rgb, frgb, num_samples * 2);
-    rgbToLab->convert(frgb, lab, num_samples * 2);
-    
-//    for(int i = 0; i < num_samples * 2 * DATA_DIM; i+=3)
-//    {
-//        color::print_RGB(&rgb[i]);
-//        color::print_RGB(&frgb[i]);
-//        color::print_Lab(&lab[i]);
-//    }
-    
-    for(int i = 0; i < num_samples; ++i)
+    else
     {
-        float ci[3];
-        float di[3];
+        std::vector<unsigned char> rgb;
+        int num_samples = 0;
         
-        for(int j = 0; j < DATA_DIM; ++j)
-        {
-            ci[j] = lab[i * (2 * DATA_DIM) + j];
-            support(i,j) = ci[j];
-        }
+        if (!data::readColorSamples(color_samples_file, rgb, num_samples))
+            return -1;
         
-        for(int j = 0; j < DATA_DIM; ++j)
+        // exact mode runs the full conversion chain, memoized per 8 bit input color,
+        // rbf mode evaluates the interpolator on every pixel, lut8 runs all in 8 bit integers
+        balance::CorrectionMode mode = balance::MODE_LUT;
+        
+        if (argc > 3 && !balance::parseCorrectionMode(argv[3], mode))
         {
-            di[j] = lab[i * (2 * DATA_DIM) + j + DATA_DIM];
-            values[j](i) = di[j] - ci[j];
+            printf("Unknown mode %s.\n", argv[3]);
+            return -1;
         }
+        
+        const balance::ColorBalancer::Mode modes[] = { balance::ColorBalancer::LUT, balance::ColorBalancer::EXACT,
+                                                       balance::ColorBalancer::RBF, balance::ColorBalancer::LUT8 };
+        options.mode = modes[mode];
+        options.lut_size = argc > 4 ? atoi(argv[4]) : LUT_SIZE;
+        options.support_radius = argc > 6 ? (float)atof(argv[6]) : 0.0f;
+        
+        balancer.reset(new balance::ColorBalancer(options));
+        
+        if (!balancer->fit(&rgb[0], num_samples))
+            return -1;
     }
     
+    const rbf::FitReport& report = balancer->model()->fitReport();
+    printf("Fit %d samples with %s in %.3f ms, relative residual %g\n", report.num_samples,
+           rbf::solverName(report.solver), report.solve_seconds * 1000.0, report.relative_residual);
     
-    free(rgb);
-    free(frgb);
-    free(lab);
-    
-    //std::cout << support << std::endl;
-
-    rbf::RBF_interpolation<float, DATA_DIM, rbf::RBF_fn_NormShepard>* rbf[3];
-    
-    rbf[R] = new rbf::RBF_interpolation<float, DATA_DIM, rbf::RBF_fn_NormShepard>(support, values[R], true);
-    rbf[G] = new rbf::RBF_interpolation<float, DATA_DIM, rbf::RBF_fn_NormShepard>(support, values[G], true);
-    rbf[B] = new rbf::RBF_interpolation<float, DATA_DIM, rbf::RBF_fn_NormShepard>(support, values[B], true);
-    
+    if (argc > 7 && !balancer->save(argv[7]))
+        return -1;
     
     const char* imgfile1 = argv[1];
     //const char* imgfile2 = argv[2];
     
     cv::Mat img1, img2;
     
-    img1 = cv::imread(imgfile1);
-    img2 = cv::imread(imgfile1);
+    {
+        PROFILE_SCOPE(TIMER_READ);
+        img1 = cv::imread(imgfile1);
+        img2 = cv::imread(imgfile1);
+    }
     
     if (!img1.data || !img2.data)
     {
@@ -128,37 +96,10 @@ int main(int argc, char** argv)
     
     assert(img2.depth() == CV_8U && channels == 3);
     
-    unsigned char crgb[3];
-    float cfrgb[3];
-    float clab[3];
-    Eigen::Matrix<float, 1, DATA_DIM> val;
+    balancer->applyInPlace(img2);
     
-    cv::MatIterator_<cv::Vec3b> it, end;
-    for( it = img2.begin<cv::Vec3b>(), end = img2.end<cv::Vec3b>(); it != end; ++it)
-    {
-        
-        crgb[B] = (*it)[R];
-        crgb[G] = (*it)[G];
-        crgb[R] = (*it)[B];
-        
-        color::RGB255_to_RGB01(crgb, cfrgb);
-        rgbToLab->convert(cfrgb, clab, 1);
-        
-        val(R) = clab[R];
-        val(G) = clab[G];
-        val(B) = clab[B];
-        
-        clab[R] += rbf[R]->interpolate(val);
-        clab[G] += rbf[G]->interpolate(val);
-        clab[B] += rbf[B]->interpolate(val);
-        
-        labToRgb->convert(clab, cfrgb, 1);
-        color::RGB01_to_RGB255(cfrgb, crgb);
-        
-        (*it)[R] = crgb[B];
-        (*it)[G] = crgb[G];
-        (*it)[B] = crgb[R];
-    }
+    if (profile::enabled())
+        profile::printText(stdout);
     
     cv::Mat comp(cv::Size(img1.cols + img2.cols, cv::max(img1.rows, img2.rows)), CV_8UC3);
     
@@ -192,11 +133,5 @@ int main(int argc, char** argv)
         cv::imshow(imageTitle, compSmall);
     }
     
-    delete rgbToLab;
-    delete labToRgb;
-    delete rbf[R];
-    delete rbf[G];
-    delete rbf[B];
-    
     return 0;
 }
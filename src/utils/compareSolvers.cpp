@@ -0,0 +1,80 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <balance.h>
+#include <datahelpers.h>
+
+#define DATA_DIM 3
+
+// Fits the color balancing interpolator with every solver and reports fit time and residual,
+// on a color samples file or on random correspondences.
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Please enter a color samples file or a number of random samples. Optionally, the number of repetitions.\n");
+        return -1;
+    }
+
+    std::vector<unsigned char> rgb;
+    int num_samples = 0;
+
+    char* end = NULL;
+    long count = strtol(argv[1], &end, 10);
+
+    if (*end == '\0' && count > 0)
+    {
+        // random source colors, targets a few levels away
+        num_samples = (int)count;
+        rgb.resize(num_samples * DATA_DIM * 2);
+
+        srand(1);
+
+        for(int i = 0; i < num_samples; ++i)
+        {
+            for(int j = 0; j < DATA_DIM; ++j)
+            {
+                int src = rand() % 256;
+                rgb[i * 2 * DATA_DIM + j] = (unsigned char)src;
+                rgb[i * 2 * DATA_DIM + DATA_DIM + j] = (unsigned char)std::min(255, std::max(0, src + rand() % 41 - 20));
+            }
+        }
+    }
+    else if (!data::readColorSamples(argv[1], rgb, num_samples))
+    {
+        return -1;
+    }
+
+    const int repeats = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+
+    Eigen::Matrix<float, Eigen::Dynamic, 3> support, values;
+    balance::samplesToLab(&rgb[0], num_samples, support, values);
+
+    const rbf::SolverType solvers[] = { rbf::SOLVER_LDLT, rbf::SOLVER_PARTIAL_LU, rbf::SOLVER_COD, rbf::SOLVER_JACOBI_SVD };
+
+    printf("%d samples, best of %d\n", num_samples, repeats);
+    printf("%-8s %-8s %14s %14s\n", "solver", "used", "solve ms", "residual");
+
+    for(size_t s = 0; s < sizeof(solvers) / sizeof(solvers[0]); ++s)
+    {
+        rbf::FitReport best = rbf::FitReport();
+        best.solve_seconds = -1.0;
+
+        for(int r = 0; r < repeats; ++r)
+        {
+            balance::Interpolator interp(support, values, true, solvers[s]);
+
+            if (best.solve_seconds < 0.0 || interp.fitReport().solve_seconds < best.solve_seconds)
+                best = interp.fitReport();
+        }
+
+        printf("%-8s %-8s %14.3f %14.3e\n",
+               rbf::solverName(solvers[s]),
+               rbf::solverName(best.solver),
+               best.solve_seconds * 1000.0,
+               best.relative_residual);
+    }
+
+    return 0;
+}
@@ -28,7 +28,6 @@ int main(int argc, char** argv)
     vals = (vals + ones) * 50.0;
     
     data::tofile<double, DATA_DIM>(filename,
-                                   "%0.6lf",
                                    n,
                                    pts,
                                    vals);
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <balance.h>
+#include <reduction.h>
+#include <datahelpers.h>
+
+#define HOLDOUT_EVERY 10
+#define NUM_QUERIES (1 << 18)
+
+// Reduces a color samples file and reports what it saves: fit and evaluation time of the
+// interpolator on the full and on the reduced training set, and the error of both on held
+// out samples (every HOLDOUT_EVERY-th sample, never seen by either fit).
+
+struct Evaluation
+{
+    int samples;
+    double fit_ms;
+    double eval_ms;
+    double mean_error;
+    double p95_error;           // robust to the outliers among the held out samples
+    double max_error;
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+}
+
+static Evaluation evaluate(const std::vector<unsigned char>& training, const std::vector<unsigned char>& holdout)
+{
+    Evaluation e;
+    e.samples = (int)training.size() / 6;
+
+    Eigen::Matrix<float, Eigen::Dynamic, 3> support, values;
+    balance::samplesToLab(&training[0], e.samples, support, values);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    balance::Interpolator interp(support, values, true);
+    e.fit_ms = elapsedMs(start);
+
+    // the same pseudo random Lab colors for every evaluation
+    std::vector<float> planes(NUM_QUERIES * 6);
+    srand(1);
+
+    for(int i = 0; i < NUM_QUERIES; ++i)
+    {
+        planes[i] = 100.0f * rand() / RAND_MAX;
+        planes[NUM_QUERIES + i] = 200.0f * rand() / RAND_MAX - 100.0f;
+        planes[2 * NUM_QUERIES + i] = 200.0f * rand() / RAND_MAX - 100.0f;
+    }
+
+    const float* in[] = { &planes[0], &planes[NUM_QUERIES], &planes[2 * NUM_QUERIES] };
+    float* out[] = { &planes[3 * NUM_QUERIES], &planes[4 * NUM_QUERIES], &planes[5 * NUM_QUERIES] };
+
+    start = std::chrono::steady_clock::now();
+    interp.interpolate(in, out, NUM_QUERIES);
+    e.eval_ms = elapsedMs(start);
+
+    // Delta E between predicted and actual target colors of the held out samples
+    const int num_holdout = (int)holdout.size() / 6;
+    Eigen::Matrix<float, Eigen::Dynamic, 3> test_support, test_values;
+    balance::samplesToLab(&holdout[0], num_holdout, test_support, test_values);
+
+    std::vector<double> errors(num_holdout);
+    e.mean_error = 0.0;
+
+    for(int i = 0; i < num_holdout; ++i)
+    {
+        Eigen::Matrix<float, 1, 3> predicted = interp.interpolate(test_support.row(i));
+        errors[i] = (predicted - test_values.row(i)).norm();
+        e.mean_error += errors[i] / num_holdout;
+    }
+
+    std::sort(errors.begin(), errors.end());
+    e.p95_error = errors[(num_holdout - 1) * 95 / 100];
+    e.max_error = errors.back();
+
+    return e;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Please enter a color samples file. Optionally, the sample budget (0: none), the Lab merge distance, "
+               "the outlier threshold in Lab units (0: none) and a file to write the reduced samples to.\n");
+        return -1;
+    }
+
+    std::vector<unsigned char> rgb;
+    int num_samples = 0;
+
+    if (!data::readColorSamples(argv[1], rgb, num_samples))
+        return -1;
+
+    reduction::ReductionOptions options;
+    options.budget = argc > 2 ? atoi(argv[2]) : options.budget;
+    options.merge_distance = argc > 3 ? (float)atof(argv[3]) : options.merge_distance;
+    options.outlier_threshold = argc > 4 ? (float)atof(argv[4]) : options.outlier_threshold;
+
+    if (num_samples < 2 * HOLDOUT_EVERY)
+    {
+        printf("Not enough samples to hold %d%% out.\n", 100 / HOLDOUT_EVERY);
+        return -1;
+    }
+
+    std::vector<unsigned char> training, holdout;
+
+    for(int i = 0; i < num_samples; ++i)
+    {
+        std::vector<unsigned char>& set = i % HOLDOUT_EVERY == HOLDOUT_EVERY - 1 ? holdout : training;
+        set.insert(set.end(), rgb.begin() + i * 6, rgb.begin() + (i + 1) * 6);
+    }
+
+    std::vector<unsigned char> reduced;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    reduction::ReductionReport report = reduction::reduceSamples(&training[0], (int)training.size() / 6, options, reduced);
+    double reduce_ms = elapsedMs(start);
+
+    printf("%d training samples: %d outliers, %d after merging, %d after k-means, in %.2f ms\n",
+           report.input, report.outliers, report.merged, report.output, reduce_ms);
+
+    Evaluation full = evaluate(training, holdout);
+    Evaluation small = evaluate(reduced, holdout);
+
+    printf("%d held out samples, %d evaluations\n", (int)holdout.size() / 6, NUM_QUERIES);
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "set", "samples", "fit ms", "eval ms", "mean dE", "p95 dE", "max dE");
+
+    const char* names[] = { "full", "reduced" };
+    const Evaluation* sets[] = { &full, &small };
+
+    for(int i = 0; i < 2; ++i)
+        printf("%-8s %8d %10.2f %10.2f %10.3f %10.3f %10.3f\n", names[i], sets[i]->samples, sets[i]->fit_ms, sets[i]->eval_ms,
+               sets[i]->mean_error, sets[i]->p95_error, sets[i]->max_error);
+
+    // the written file reduces all the samples, held out ones included
+    if (argc > 5)
+    {
+        reduction::reduceSamples(&rgb[0], num_samples, options, reduced);
+
+        if (!data::writeColorSamples(argv[5], &reduced[0], (int)reduced.size() / 6))
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <sampling.h>
+#include <datahelpers.h>
+#include <opencv2/opencv.hpp>
+
+/*
+ * Extracts color correspondences between two aligned images without user interaction:
+ * patch averages on a regular grid, merged in Lab, written as a color samples file
+ */
+int main(int argc, char** argv)
+{
+    if(argc < 4)
+    {
+        printf("Please specify path to two aligned images and output file. Optionally, the patch size, "
+               "the Lab merge distance (0 keeps all), the patch selection (uniform or grid), "
+               "the largest patch deviation in 8 bit levels and the number of threads.\n");
+        return -1;
+    }
+
+    const char* imgfile1 = argv[1];
+    const char* imgfile2 = argv[2];
+    const char* outputfile = argv[3];
+
+    sampling::SamplerOptions options;
+    options.patch_size = argc > 4 ? atoi(argv[4]) : options.patch_size;
+    options.merge_distance = argc > 5 ? (float)atof(argv[5]) : options.merge_distance;
+
+    if (argc > 6)
+    {
+        if (0 == strcmp(argv[6], "grid"))
+            options.selection = sampling::PATCHES_GRID;
+        else if (0 != strcmp(argv[6], "uniform"))
+        {
+            printf("Unknown patch selection %s.\n", argv[6]);
+            return -1;
+        }
+    }
+
+    options.max_deviation = argc > 7 ? (float)atof(argv[7]) : options.max_deviation;
+    options.num_threads = argc > 8 ? atoi(argv[8]) : 0;
+
+    if (options.patch_size < 1)
+    {
+        printf("Invalid patch size.\n");
+        return -1;
+    }
+
+    cv::Mat img1, img2;
+
+    img1 = cv::imread(imgfile1);
+    img2 = cv::imread(imgfile2);
+
+    if (!img1.data || !img2.data)
+    {
+        printf("No image data \n");
+        return -1;
+    }
+
+    if (img1.size() != img2.size())
+    {
+        printf("The images must be aligned and of the same size.\n");
+        return -1;
+    }
+
+    std::vector<unsigned char> rgb;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int num_samples = sampling::extractCorrespondences(img1, img2, options, rgb);
+
+    double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+
+    if (num_samples <= 0)
+    {
+        printf("No correspondences found.\n");
+        return -1;
+    }
+
+    printf("%d samples in %.2f ms\n", num_samples, ms);
+
+    if (!data::writeColorSamples(outputfile, &rgb[0], num_samples))
+        return -1;
+
+    return 0;
+}
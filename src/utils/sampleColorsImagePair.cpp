@@ -21,6 +21,12 @@ void mouseCallback(int event, int x, int y, int flags, void* userdata)
 {
     if(event == cv::EVENT_LBUTTONDOWN)
     {
+        if(curr_sample >= MAX_SAMPLES * 2)
+        {
+            printf("Reached %d samples, save with 'q' or undo with 'z'\n", MAX_SAMPLES);
+            return;
+        }
+        
         //cout << "Left button of the mouse is clicked - position (" << x << ", " << y << ")" << endl;
         
         cv::Vec3b s = sampler.at<cv::Vec3b>(y, x);
@@ -115,7 +121,7 @@ int main(int argc, char** argv)
         k = cv::waitKey(33);
         if(k == 27 || k == 'q') break;
         
-        if(k == 'z')
+        if(k == 'z' && curr_sample > 0)
             curr_sample--;
         if(k == 'c')
         {
@@ -131,23 +137,19 @@ int main(int argc, char** argv)
         
     }
     
-    FILE *f = fopen(outputfile, "w");
+    // samples alternate source and target, an unmatched last one is dropped
+    const int num_pairs = curr_sample / 2;
+    std::vector<unsigned char> rgb(num_pairs * 6);
     
-    if (f == NULL)
+    for(int i = 0; i < num_pairs * 2; ++i)
     {
-        printf("Error creating file!\n");
-        return false;
+        rgb[i * 3 + 0] = samples_r[i];
+        rgb[i * 3 + 1] = samples_g[i];
+        rgb[i * 3 + 2] = samples_b[i];
     }
     
-    fprintf(f, "%d\n", curr_sample / 2);
-    
-    for(int i = 0; i < curr_sample; ++i)
-    {
-        fprintf(f, "%d %d %d", samples_r[i], samples_g[i], samples_b[i]);
-        fprintf(f, i % 2 ? "\n" : " ");
-    }
+    if (!data::writeColorSamples(outputfile, rgb.data(), num_pairs))
+        return -1;
     
-    fclose(f);
-
     return 0;
 }
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <csignal>
+#include <cstring>
+#include <stream.h>
+#include <datahelpers.h>
+#include <opencv2/opencv.hpp>
+
+#define DEFAULT_FPS 30.0
+
+// Color balances a video or an image sequence (e.g. frames/%04d.png) with a persistent model.
+// The samples argument is either one color samples file, fitted once, or a printf pattern
+// with the frame index (e.g. samples/%04d.txt): a frame without a samples file keeps the
+// current model. Output is a video file, "show" for a window or "-" for none (benchmark).
+// A queue depth above 0 overlaps capture, correction and output on separate threads.
+// Refits run in the background unless disabled, frames keep the previous model meanwhile.
+// Built with ARCB_PROFILE, the per stage profile is printed at the end, and on demand to
+// stderr on SIGUSR1 (text) or SIGUSR2 (JSON).
+
+static volatile sig_atomic_t profile_request = 0;
+
+#if !defined(_WIN32)
+static void requestProfile(int sig)
+{
+    profile_request = sig;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        printf("Please enter the video source and the color samples file or pattern. Optionally, the output (file, show or -), "
+               "the mode (lut, lut8, exact or rbf), the refit threshold, the smoothing factor, the number of threads, the number of frames, a queue depth to pipeline the stages and 0 to fit on the frame thread.\n");
+        return -1;
+    }
+
+    const char* source = argv[1];
+    const char* samples = argv[2];
+    const char* output = argc > 3 ? argv[3] : "show";
+
+    stream::StreamOptions options;
+
+    if (argc > 4 && !balance::parseCorrectionMode(argv[4], options.mode))
+    {
+        printf("Unknown mode %s.\n", argv[4]);
+        return -1;
+    }
+
+    options.refit_threshold = argc > 5 ? (float)atof(argv[5]) : options.refit_threshold;
+    options.smoothing = argc > 6 ? (float)atof(argv[6]) : options.smoothing;
+    options.num_threads = argc > 7 ? atoi(argv[7]) : 0;
+    long max_frames = argc > 8 ? atol(argv[8]) : -1;
+    options.queue_depth = argc > 9 ? atoi(argv[9]) : 0;
+    options.pipelined = options.queue_depth > 0;
+    options.async_fit = argc > 10 ? 0 != atoi(argv[10]) : true;
+
+    if (options.smoothing < 0.0f || options.smoothing >= 1.0f)
+    {
+        printf("The smoothing factor must be in [0, 1).\n");
+        return -1;
+    }
+
+    const bool show = 0 == strcmp(output, "show");
+    const bool write = !show && 0 != strcmp(output, "-");
+
+    // highgui windows belong to the main thread, the pipelined sink runs on its own
+    if (show && options.pipelined)
+    {
+        printf("Showing the output disables pipelining.\n");
+        options.pipelined = false;
+    }
+
+    stream::StreamEngine engine(options);
+
+    if (!engine.open(source))
+    {
+        printf("Could not open %s.\n", source);
+        return -1;
+    }
+
+    const bool per_frame = NULL != strchr(samples, '%');
+
+    stream::StreamEngine::SampleSource sample_source = [&](int frame_index, const cv::Mat&, std::vector<unsigned char>& rgb, int& num_samples)
+    {
+        if (!per_frame)
+            return 0 == frame_index && data::readColorSamples(samples, rgb, num_samples);
+
+        char filename[1024];
+        snprintf(filename, sizeof(filename), samples, frame_index);
+
+        FILE* f = fopen(filename, "r");
+
+        if (f == NULL)
+            return false;
+
+        fclose(f);
+        return data::readColorSamples(filename, rgb, num_samples);
+    };
+
+    cv::VideoWriter writer;
+    const char* windowTitle = "Color Balanced";
+
+    if (show)
+        cv::namedWindow(windowTitle, cv::WINDOW_AUTOSIZE);
+
+    // queried up front, a pipelined sink must not touch the capture
+    const double source_fps = engine.framesPerSecond();
+
+#if !defined(_WIN32)
+    if (profile::enabled())
+    {
+        signal(SIGUSR1, requestProfile);
+        signal(SIGUSR2, requestProfile);
+    }
+#endif
+
+    stream::StreamEngine::FrameSink sink = [&](int, const cv::Mat& corrected)
+    {
+        if (profile_request)
+        {
+#if !defined(_WIN32)
+            if (SIGUSR2 == profile_request)
+                profile::writeJSON(stderr);
+            else
+#endif
+                profile::printText(stderr);
+
+            profile_request = 0;
+        }
+
+        if (write)
+        {
+            if (!writer.isOpened())
+            {
+                writer.open(output, cv::VideoWriter::fourcc('m', 'p', '4', 'v'), source_fps > 0.0 ? source_fps : DEFAULT_FPS, corrected.size());
+
+                if (!writer.isOpened())
+                {
+                    printf("Could not create %s.\n", output);
+                    return false;
+                }
+            }
+
+            writer.write(corrected);
+        }
+        else if (show)
+        {
+            cv::imshow(windowTitle, corrected);
+
+            char k = cv::waitKey(1);
+            if (k == 27 || k == 'q')
+                return false;
+        }
+
+        return true;
+    };
+
+    engine.run(sample_source, sink, max_frames);
+
+    if (!engine.model())
+        printf("No color samples, nothing corrected.\n");
+
+    engine.streamStats().print(stdout);
+
+    if (profile::enabled())
+        profile::printText(stdout);
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <clocale>
+#include <cstdlib>
+#include <vector>
+#include <Eigen/Dense>
+#include <rbf.h>
+#include <rbfsparse.h>
+#include <colors.h>
+#include <datahelpers.h>
+#include <simd.h>
+#include <modelfile.h>
+
+// Accuracy tests run by ctest. Usage: accuracyTests [name], every test without a name.
+// Each test prints its worst error against the stated tolerance and fails above it.
+
+#define NUM_SAMPLES 64
+#define NUM_COLORS (1 << 18)
+
+typedef rbf::RBF_multi_interpolation<float, 3, 3, rbf::RBF_fn_NormShepard> Interpolator;
+typedef rbf::RBF_multi_interpolation<float, 3, 3, rbf::RBF_fn_NormShepardFast> FastInterpolator;
+typedef rbf::RBF_incremental_interpolation<float, 3, 3, rbf::RBF_fn_NormShepard> IncrementalInterpolator;
+
+// Highest level the CPU supports, whatever was forced before
+static simd::Level topLevel()
+{
+    simd::forceLevel(simd::AVX2);
+    return simd::level();
+}
+
+static const char* levelName(simd::Level level)
+{
+    const char* names[] = { "scalar", "sse2", "avx2" };
+    return names[level];
+}
+
+static bool check(const char* what, double error, double tolerance)
+{
+    const bool ok = error <= tolerance;
+    printf("  %-40s max error %-12g tolerance %-12g %s\n", what, error, tolerance, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Random source colors with targets a few levels away, as Lab points and offsets
+static void randomSamples(int n, unsigned int seed, Eigen::Matrix<float, Eigen::Dynamic, 3>& support,
+                          Eigen::Matrix<float, Eigen::Dynamic, 3>& values)
+{
+    srand(seed);
+
+    std::vector<float> rgb(n * 6), lab(n * 6);
+
+    for(int i = 0; i < n * 3; ++i)
+    {
+        const int src = rand() % 256;
+        rgb[(i / 3) * 6 + i % 3] = src / 255.0f;
+        rgb[(i / 3) * 6 + 3 + i % 3] = std::min(255, std::max(0, src + rand() % 41 - 20)) / 255.0f;
+    }
+
+    color::RGB2Lab<float> toLab(3, 2, nullptr, nullptr, true);
+    toLab.convert(&rgb[0], &lab[0], n * 2);
+
+    support.resize(n, 3);
+    values.resize(n, 3);
+
+    for(int i = 0; i < n; ++i)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            support(i, c) = lab[i * 6 + c];
+            values(i, c) = lab[i * 6 + 3 + c] - lab[i * 6 + c];
+        }
+    }
+}
+
+static void randomColors(int n, unsigned int seed, std::vector<unsigned char>& rgb)
+{
+    srand(seed);
+    rgb.resize(n * 3);
+
+    for(int i = 0; i < n * 3; ++i)
+        rgb[i] = (unsigned char)(rand() % 256);
+}
+
+// Full 8 bit correction chain RGB -> Lab -> RBF offsets -> RGB on planar rows
+template<typename TInterp>
+static void correctColors(const TInterp& interp, const std::vector<unsigned char>& rgb, std::vector<unsigned char>& out)
+{
+    const int n = (int)rgb.size() / 3;
+
+    color::RGB2Lab<float> toLab(3, 2, nullptr, nullptr, true);
+    color::Lab2RGB<float> toRGB(3, 2, nullptr, nullptr, true);
+
+    std::vector<float> planes(n * 6);
+    float* lab[] = { &planes[0], &planes[n], &planes[2 * n] };
+    float* offset[] = { &planes[3 * n], &planes[4 * n], &planes[5 * n] };
+
+    toLab.convertToPlanar(&rgb[0], 3, lab[0], lab[1], lab[2], n);
+    interp.interpolate(lab, offset, n);
+
+    for(int c = 0; c < 3; ++c)
+        for(int i = 0; i < n; ++i)
+            lab[c][i] += offset[c][i];
+
+    out.resize(rgb.size());
+    toRGB.convertFromPlanar(lab[0], lab[1], lab[2], &out[0], 3, n);
+}
+
+static int maxByteDifference(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+    int diff = 0;
+
+    for(size_t i = 0; i < a.size(); ++i)
+        diff = std::max(diff, std::abs((int)a[i] - (int)b[i]));
+
+    return diff;
+}
+
+// NormShepardFast (mathext::fastPow) against NormShepard (std::pow) through the full chain,
+// on the same support points and weights: within 1 LSB of the 8 bit output, at every SIMD level
+static bool testFastKernel()
+{
+    Eigen::Matrix<float, Eigen::Dynamic, 3> support, values;
+    randomSamples(NUM_SAMPLES, 1, support, values);
+
+    Interpolator exact(support, values, true);
+    FastInterpolator fast(exact.points().data(), exact.weights().data(), exact.size(), true,
+                          rbf::RBF_fn_NormShepardFast<float>(), exact.fitReport());
+
+    std::vector<unsigned char> rgb, expected, actual;
+    randomColors(NUM_COLORS, 2, rgb);
+
+    bool ok = true;
+    const simd::Level top = topLevel();
+
+    for(int level = simd::SCALAR; level <= top; ++level)
+    {
+        simd::forceLevel((simd::Level)level);
+
+        correctColors(exact, rgb, expected);
+        correctColors(fast, rgb, actual);
+
+        char what[64];
+        snprintf(what, sizeof(what), "fast kernel RGB, %s", levelName((simd::Level)level));
+        ok = check(what, maxByteDifference(expected, actual), 1) && ok;
+    }
+
+    simd::forceLevel(simd::AVX2);
+    return ok;
+}
+
+// SSE2 and AVX2 float converters against the scalar path over all 2^24 8 bit colors:
+// convertToPlanar within 1.2e-4 in Lab, convertFromPlanar within 1 LSB of the 8 bit output
+static bool testConverters()
+{
+    const int chunk = 1 << 16;
+
+    color::RGB2Lab<float> toLab(3, 2, nullptr, nullptr, true);
+    color::Lab2RGB<float> toRGB(3, 2, nullptr, nullptr, true);
+
+    std::vector<unsigned char> rgb(chunk * 3), expected(chunk * 3), actual(chunk * 3);
+    std::vector<float> scalar_lab(chunk * 3), lab(chunk * 3);
+
+    const simd::Level top = topLevel();
+
+    if(simd::SCALAR == top)
+        printf("  no SIMD level on this CPU, nothing to compare\n");
+
+    bool ok = true;
+
+    for(int level = simd::SSE2; level <= top; ++level)
+    {
+        double lab_error = 0.0;
+        int rgb_error = 0;
+
+        for(int first = 0; first < (1 << 24); first += chunk)
+        {
+            for(int i = 0; i < chunk; ++i)
+            {
+                const int key = first + i;
+                rgb[i * 3 + 0] = (unsigned char)(key >> 16);
+                rgb[i * 3 + 1] = (unsigned char)(key >> 8);
+                rgb[i * 3 + 2] = (unsigned char)key;
+            }
+
+            float* sl[] = { &scalar_lab[0], &scalar_lab[chunk], &scalar_lab[2 * chunk] };
+            float* l[] = { &lab[0], &lab[chunk], &lab[2 * chunk] };
+
+            simd::forceLevel(simd::SCALAR);
+            toLab.convertToPlanar(&rgb[0], 3, sl[0], sl[1], sl[2], chunk);
+            toRGB.convertFromPlanar(sl[0], sl[1], sl[2], &expected[0], 3, chunk);
+
+            simd::forceLevel((simd::Level)level);
+            toLab.convertToPlanar(&rgb[0], 3, l[0], l[1], l[2], chunk);
+            toRGB.convertFromPlanar(sl[0], sl[1], sl[2], &actual[0], 3, chunk);
+
+            for(int i = 0; i < chunk * 3; ++i)
+                lab_error = std::max(lab_error, (double)std::fabs(lab[i] - scalar_lab[i]));
+
+            rgb_error = std::max(rgb_error, maxByteDifference(expected, actual));
+        }
+
+        char what[64];
+        snprintf(what, sizeof(what), "convertToPlanar Lab, %s", levelName((simd::Level)level));
+        ok = check(what, lab_error, 1.2e-4) && ok;
+
+        snprintf(what, sizeof(what), "convertFromPlanar RGB, %s", levelName((simd::Level)level));
+        ok = check(what, rgb_error, 1) && ok;
+    }
+
+    simd::forceLevel(simd::AVX2);
+    return ok;
+}
+
+// Incremental add / remove sequences without periodic refit, the worst case for rounding:
+// the weights must match a full fit on the same samples within 1e-4 of their largest magnitude
+static bool testIncremental()
+{
+    const int initial = 200, steps = 400;
+
+    Eigen::Matrix<float, Eigen::Dynamic, 3> support, values;
+    randomSamples(initial + steps, 3, support, values);
+
+    IncrementalInterpolator inc(support.topRows(initial), values.topRows(initial), true, 0);
+
+    srand(4);
+    int next = initial, rejected = 0;
+
+    for(int s = 0; s < steps; ++s)
+    {
+        // mostly adds early on, then mostly removes, with runs of each
+        if(inc.size() > 16 && rand() % steps < s)
+            inc.removeSample(rand() % inc.size());
+        else
+        {
+            rejected += !inc.addSample(support.row(next), values.row(next));
+            ++next;
+        }
+    }
+
+    Interpolator full(inc.points(), inc.values(), true);
+
+    const float scale = full.weights().cwiseAbs().maxCoeff();
+    const float weight_error = (inc.weights() - full.weights()).cwiseAbs().maxCoeff() / scale;
+
+    printf("  %d samples after %d updates, %d adds rejected\n", inc.size(), steps, rejected);
+    return check("incremental weights, relative", weight_error, 1e-4);
+}
+
+// A grid whose range is just below a multiple of the cell size, where the cell count of
+// an axis in float rounds up past the one in double: every point must be found by a query
+// at its own position, and a query over the whole range must find each point once
+static bool testSparseGrid()
+{
+    const float range = 124.283852f, cell = 20.7139759f;
+    const int n = 512;
+
+    Eigen::Matrix<float, Eigen::Dynamic, 3> pts(n, 3);
+    srand(6);
+
+    for(int i = 0; i < n; ++i)
+        for(int c = 0; c < 3; ++c)
+            pts(i, c) = i < 8 ? ((i >> c) & 1) * range : range * (rand() / (float)RAND_MAX);
+
+    rbf::UniformGrid<float, 3> grid;
+    grid.build(pts.data(), n, cell);
+
+    struct Collect
+    {
+        std::vector<int> hits;
+        void operator()(int i) { ++hits[i]; }
+    } all, own;
+
+    all.hits.assign(n, 0);
+
+    const float middle[] = { range / 2, range / 2, range / 2 };
+    grid.query(middle, range, all);
+
+    int missed = 0;
+
+    for(int i = 0; i < n; ++i)
+    {
+        own.hits.assign(n, 0);
+        const float x[] = { pts(i, 0), pts(i, 1), pts(i, 2) };
+        grid.query(x, 0.0f, own);
+
+        missed += own.hits[i] != 1 || all.hits[i] != 1;
+    }
+
+    return check("grid points missed", missed, 0);
+}
+
+// tofile -> fromfile of random reals of every magnitude, bit for bit
+template<typename T>
+static bool pointsRoundTrip(const char* filename, const char* what)
+{
+    const int n = 1000;
+
+    Eigen::Matrix<T, Eigen::Dynamic, 3, Eigen::RowMajor> pts(n, 3), read_pts;
+    Eigen::Matrix<T, Eigen::Dynamic, 1> vals(n), read_vals;
+    srand(7);
+
+    for(int i = 0; i < n; ++i)
+    {
+        for(int c = 0; c < 3; ++c)
+            pts(i, c) = (T)((rand() / (double)RAND_MAX - 0.5) * std::pow(10.0, rand() % 61 - 30));
+
+        vals(i) = (T)(rand() / (double)RAND_MAX + rand());
+    }
+
+    const bool ok = data::tofile<T, 3>(filename, n, pts, vals) && data::fromfile<T, 3>(filename, read_pts, read_vals) &&
+                    read_pts.rows() == n && read_vals.rows() == n &&
+                    0 == memcmp(pts.data(), read_pts.data(), n * 3 * sizeof(T)) &&
+                    0 == memcmp(vals.data(), read_vals.data(), n * sizeof(T));
+
+    return check(what, ok ? 0 : 1, 0);
+}
+
+// writeColorSamples -> readColorSamples and tofile -> fromfile give back the exact same
+// values, also when the program runs in a locale with a decimal comma
+static bool testSampleFiles()
+{
+    const char* filename = "accuracyTests_samples.txt";
+
+    std::vector<unsigned char> rgb, read_rgb;
+    randomColors(NUM_SAMPLES * 20, 8, rgb);
+
+    int num_samples = 0;
+    const bool samples_ok = data::writeColorSamples(filename, &rgb[0], NUM_SAMPLES * 10) &&
+                            data::readColorSamples(filename, read_rgb, num_samples) &&
+                            NUM_SAMPLES * 10 == num_samples && rgb == read_rgb;
+
+    bool ok = check("color samples round trip", samples_ok ? 0 : 1, 0);
+
+    ok = pointsRoundTrip<float>(filename, "float points round trip") && ok;
+    ok = pointsRoundTrip<double>(filename, "double points round trip") && ok;
+
+    const char* comma_locales[] = { "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "German_Germany.1252" };
+    const char* comma_locale = nullptr;
+
+    for(size_t i = 0; i < sizeof(comma_locales) / sizeof(comma_locales[0]) && !comma_locale; ++i)
+        if(setlocale(LC_NUMERIC, comma_locales[i]) && ',' == localeconv()->decimal_point[0])
+            comma_locale = comma_locales[i];
+
+    if(comma_locale)
+    {
+        char what[64];
+        snprintf(what, sizeof(what), "double points round trip, %s", comma_locale);
+        ok = pointsRoundTrip<double>(filename, what) && ok;
+        setlocale(LC_NUMERIC, "C");
+    }
+    else
+    {
+        printf("  no decimal comma locale installed, locale round trip skipped\n");
+    }
+
+    remove(filename);
+    return ok;
+}
+
+// Bytes of a matrix or lut, to compare a loaded model bit for bit with the saved one
+static bool sameBytes(const void* a, const void* b, size_t bytes)
+{
+    return 0 == memcmp(a, b, bytes);
+}
+
+static bool sameModel(const balance::Model& a, const balance::Model& b)
+{
+    bool ok = a.correctionMode() == b.correctionMode() && (!a.sparseInterpolator()) == (!b.sparseInterpolator());
+
+    if(ok && a.sparseInterpolator())
+        ok = a.sparseInterpolator()->size() == b.sparseInterpolator()->size() &&
+             a.sparseInterpolator()->points() == b.sparseInterpolator()->points() &&
+             a.sparseInterpolator()->weights() == b.sparseInterpolator()->weights();
+    else if(ok)
+        ok = a.interpolator()->size() == b.interpolator()->size() &&
+             a.interpolator()->points() == b.interpolator()->points() &&
+             a.interpolator()->weights() == b.interpolator()->weights();
+
+    if(ok && a.colorLUT())
+        ok = b.colorLUT() && a.colorLUT()->entries() == b.colorLUT()->entries() &&
+             sameBytes(a.colorLUT()->data(), b.colorLUT()->data(), a.colorLUT()->entries() * sizeof(float));
+
+    if(ok && a.colorLUT8())
+        ok = b.colorLUT8() && a.colorLUT8()->entries() == b.colorLUT8()->entries() &&
+             sameBytes(a.colorLUT8()->data(), b.colorLUT8()->data(), a.colorLUT8()->entries() * sizeof(int16_t));
+
+    return ok;
+}
+
+// Writes bytes [0, size) of data to filename, size may cut it short
+static bool writeBytes(const char* filename, const std::vector<unsigned char>& data, size_t size)
+{
+    FILE* f = fopen(filename, "wb");
+
+    if(f == NULL)
+        return false;
+
+    const bool ok = fwrite(&data[0], 1, size, f) == size;
+    return 0 == fclose(f) && ok;
+}
+
+// saveModel -> loadModel restores every mode, dense and sparse, bit for bit; truncated files
+// and corrupted headers must load as null
+static bool testModelFile()
+{
+    const char* filename = "accuracyTests_model.bin";
+
+    std::vector<unsigned char> rgb;
+    randomColors(NUM_SAMPLES * 2, 5, rgb);
+
+    const balance::CorrectionMode modes[] = { balance::MODE_LUT, balance::MODE_EXACT, balance::MODE_RBF, balance::MODE_LUT8 };
+    const char* names[] = { "lut", "exact", "rbf", "lut8" };
+
+    bool ok = true;
+
+    for(int m = 0; m < 4; ++m)
+    {
+        for(int sparse = 0; sparse < 2; ++sparse)
+        {
+            balance::Model model(&rgb[0], NUM_SAMPLES, modes[m], 17, rbf::SOLVER_LDLT, sparse ? 30.0f : 0.0f);
+
+            std::shared_ptr<balance::Model> loaded;
+
+            if(balance::saveModel(model, filename))
+                loaded = balance::loadModel(filename);
+
+            char what[64];
+            snprintf(what, sizeof(what), "round trip, %s %s", names[m], sparse ? "sparse" : "dense");
+            ok = check(what, loaded && sameModel(model, *loaded) ? 0 : 1, 0) && ok;
+        }
+    }
+
+    // the last file written, sparse lut8, as the base of the corrupted ones
+    std::vector<unsigned char> file;
+    FILE* f = fopen(filename, "rb");
+
+    if(f)
+    {
+        unsigned char buffer[4096];
+        size_t read;
+
+        while((read = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            file.insert(file.end(), buffer, buffer + read);
+
+        fclose(f);
+    }
+
+    if(file.size() < sizeof(balance::ModelFileHeader))
+    {
+        remove(filename);
+        return check("model file read back", 1, 0);
+    }
+
+    struct Corruption
+    {
+        const char* what;
+        size_t offset;          // of a uint32 set to value, or where the file is cut if value is 0
+        uint32_t value;
+    };
+
+    const Corruption corruptions[] =
+    {
+        { "truncated in the header", sizeof(balance::ModelFileHeader) / 2, 0 },
+        { "truncated in the lut", file.size() - 1, 0 },
+        { "bad magic", offsetof(balance::ModelFileHeader, magic), 0x58585858 },
+        { "unknown version", offsetof(balance::ModelFileHeader, version), balance::MODEL_FILE_VERSION + 1 },
+        { "short header_bytes", offsetof(balance::ModelFileHeader, header_bytes), 16 },
+        { "swapped byte order", offsetof(balance::ModelFileHeader, byte_order), 0x04030201 },
+        { "unknown mode", offsetof(balance::ModelFileHeader, mode), 99 },
+        { "num_points past the file", offsetof(balance::ModelFileHeader, num_points), 1u << 30 },
+        { "lut_size not 2^k + 1", offsetof(balance::ModelFileHeader, lut_size), 16 },
+        { "wrapping weights_offset", offsetof(balance::ModelFileHeader, weights_offset) + 4, 0xffffffff },
+    };
+
+    for(size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); ++i)
+    {
+        const Corruption& c = corruptions[i];
+        std::vector<unsigned char> bad(file);
+
+        if(c.value)
+            memcpy(&bad[c.offset], &c.value, sizeof(c.value));
+
+        bool rejected = false;
+
+        if(writeBytes(filename, bad, c.value ? bad.size() : c.offset))
+            rejected = !balance::loadModel(filename);
+
+        ok = check(c.what, rejected ? 0 : 1, 0) && ok;
+    }
+
+    remove(filename);
+    return ok;
+}
+
+struct Test
+{
+    const char* name;
+    bool (*run)();
+};
+
+int main(int argc, char** argv)
+{
+    const Test tests[] =
+    {
+        { "fast_kernel", testFastKernel },
+        { "converters", testConverters },
+        { "incremental", testIncremental },
+        { "model_file", testModelFile },
+        { "sparse_grid", testSparseGrid },
+        { "sample_files", testSampleFiles },
+    };
+
+    const int num_tests = sizeof(tests) / sizeof(tests[0]);
+    int failed = 0, ran = 0;
+
+    for(int i = 0; i < num_tests; ++i)
+    {
+        if(argc > 1 && 0 != strcmp(argv[1], tests[i].name))
+            continue;
+
+        printf("%s\n", tests[i].name);
+        failed += !tests[i].run();
+        ++ran;
+    }
+
+    if(!ran)
+    {
+        printf("Unknown test %s.\n", argv[1]);
+        return -1;
+    }
+
+    printf("%d of %d tests passed\n", ran - failed, ran);
+    return failed ? 1 : 0;
+}